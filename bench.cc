@@ -0,0 +1,581 @@
+//benchmarks for every index over uniform, clustered and moving workloads
+//usage: bench [--max-items N] [--csv path] [--json path]
+//sizes run in powers of ten from 1000 up to --max-items (default 100000),
+//in 2 and 3 dimensions, reporting ns/op for each operation and peak and
+//retained heap bytes for the build
+
+#include <vector>
+#include <array>
+#include <string>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <new>
+
+#include "tree.hh"
+#include "list.hh"
+#include "graph.hh"
+#include "kdtree.hh"
+#include "flat_map.hh"
+
+//every allocation carries its size in a header so the live heap and its
+//peak can be counted
+namespace memory {
+std::atomic<size_t> current {0};
+std::atomic<size_t> peak {0};
+constexpr size_t header = alignof(std::max_align_t);
+
+void* allocate(size_t n) {
+    char* p = static_cast<char*>(std::malloc(n + header));
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    std::memcpy(p, &n, sizeof(n));
+    size_t now = current += n;
+    size_t seen = peak;
+    while (now > seen && !peak.compare_exchange_weak(seen, now)) {}
+    return p + header;
+}
+void deallocate(void* q) {
+    if (q == nullptr) {
+        return;
+    }
+    char* p = static_cast<char*>(q) - header;
+    size_t n;
+    std::memcpy(&n, p, sizeof(n));
+    current -= n;
+    std::free(p);
+}
+void reset_peak() {
+    peak = current.load();
+}
+}
+
+void* operator new(size_t n) {
+    return memory::allocate(n);
+}
+void* operator new[](size_t n) {
+    return memory::allocate(n);
+}
+void operator delete(void* p) noexcept {
+    memory::deallocate(p);
+}
+void operator delete[](void* p) noexcept {
+    memory::deallocate(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    memory::deallocate(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    memory::deallocate(p);
+}
+
+using coord = uint32_t;
+constexpr coord world = coord{1} << 20;
+template<size_t D>
+using position = std::array<coord, D>;
+template<size_t D>
+struct box {
+    position<D> min;
+    position<D> max;
+};
+
+enum op : unsigned {
+    has_build = 1,
+    has_insert = 2,
+    has_move = 4,
+    has_remove = 8,
+    has_point = 16,
+    has_area = 32,
+    has_radius = 64,
+    has_knn = 128,
+};
+
+//adapters give every index the same interface, ops lists what it supports
+//and linear marks indexes whose queries scan everything
+template<size_t D, size_t max_items, tree::storage st>
+struct tree_index {
+    using index = tree::tree<D, coord, uint32_t, max_items, st>;
+    static constexpr unsigned ops = has_build | has_insert | has_move | has_remove | has_point | has_area | has_radius | has_knn;
+    static constexpr bool linear = false;
+    index t {};
+    typename index::cursor c;
+    std::vector<typename index::item_id> out;
+
+    void build(const std::vector<position<D>>& ps) {
+        std::vector<typename index::item> is;
+        is.reserve(ps.size());
+        for (uint32_t i = 0; i < ps.size(); i++) {
+            is.push_back({ps[i], i, 0});
+        }
+        t.insert_items(is);
+    }
+    void insert(uint32_t id, const position<D>& p) {
+        t.insert_item(id, p);
+    }
+    void move(const std::vector<std::pair<uint32_t, position<D>>>& moves) {
+        t.update_positions(moves);
+    }
+    void remove(uint32_t id) {
+        t.remove_item(*t.find_item(id));
+    }
+    size_t point(const position<D>& p) {
+        typename index::area a;
+        for (size_t i = 0; i < D; i++) {
+            a.min[i] = p[i];
+            a.max[i] = p[i] + 1;
+        }
+        size_t n = 0;
+        t.for_each_item_within_area(c, a, [&](auto) { n++; });
+        return n;
+    }
+    size_t area(const box<D>& b) {
+        size_t n = 0;
+        t.for_each_item_within_area(c, {b.min, b.max}, [&](auto) { n++; });
+        return n;
+    }
+    size_t radius(const position<D>& p, coord r) {
+        size_t n = 0;
+        t.for_each_item_within_radius(c, p, r, [&](auto) { n++; });
+        return n;
+    }
+    size_t knn(const position<D>& p, size_t k) {
+        out.clear();
+        t.nearest(c, p, k, std::back_inserter(out));
+        return out.size();
+    }
+};
+
+template<size_t D>
+struct list_index {
+    using index = list::list<D, coord, uint32_t>;
+    static constexpr unsigned ops = has_build | has_insert | has_point | has_area;
+    static constexpr bool linear = false;
+    index l {};
+
+    void build(const std::vector<position<D>>& ps) {
+        std::vector<typename index::item> is;
+        is.reserve(ps.size());
+        for (uint32_t i = 0; i < ps.size(); i++) {
+            is.emplace_back(ps[i], i);
+        }
+        l.insert_items(is);
+    }
+    void insert(uint32_t id, const position<D>& p) {
+        l.insert_item(id, p);
+    }
+    void move(const std::vector<std::pair<uint32_t, position<D>>>&) {}
+    void remove(uint32_t) {}
+    size_t point(const position<D>& p) {
+        return l.find_item(p) ? 1 : 0;
+    }
+    size_t area(const box<D>& b) {
+        size_t n = 0;
+        l.for_each_item_within_area({b.min, b.max}, [&](auto) { n++; });
+        return n;
+    }
+    size_t radius(const position<D>&, coord) {
+        return 0;
+    }
+    size_t knn(const position<D>&, size_t) {
+        return 0;
+    }
+};
+
+template<size_t D>
+struct graph_index {
+    using index = graph::graph<D, coord, uint32_t>;
+    static constexpr unsigned ops = has_build | has_insert | has_move | has_remove;
+    static constexpr bool linear = false;
+    index g {};
+
+    void build(const std::vector<position<D>>& ps) {
+        std::vector<typename index::item> is;
+        is.reserve(ps.size());
+        for (uint32_t i = 0; i < ps.size(); i++) {
+            is.emplace_back(ps[i], i);
+        }
+        g.insert_items(is);
+    }
+    void insert(uint32_t id, const position<D>& p) {
+        g.insert_item(id, p);
+    }
+    void move(const std::vector<std::pair<uint32_t, position<D>>>& moves) {
+        g.update_positions(moves);
+    }
+    void remove(uint32_t id) {
+        g.remove_item(id);
+    }
+    size_t point(const position<D>&) {
+        return 0;
+    }
+    size_t area(const box<D>&) {
+        return 0;
+    }
+    size_t radius(const position<D>&, coord) {
+        return 0;
+    }
+    size_t knn(const position<D>&, size_t) {
+        return 0;
+    }
+};
+
+template<size_t D>
+struct kdtree_index {
+    using index = kdtree::kdtree<D, coord, uint32_t>;
+    static constexpr unsigned ops = has_build | has_point | has_area | has_radius | has_knn;
+    static constexpr bool linear = false;
+    index k {};
+
+    void build(const std::vector<position<D>>& ps) {
+        std::vector<typename index::item> is;
+        is.reserve(ps.size());
+        for (uint32_t i = 0; i < ps.size(); i++) {
+            is.push_back({ps[i], i});
+        }
+        k.build(std::move(is));
+    }
+    void insert(uint32_t, const position<D>&) {}
+    void move(const std::vector<std::pair<uint32_t, position<D>>>&) {}
+    void remove(uint32_t) {}
+    size_t point(const position<D>& p) {
+        return k.find_item(p) ? 1 : 0;
+    }
+    size_t area(const box<D>& b) {
+        size_t n = 0;
+        k.for_each_item_within_area({b.min, b.max}, [&](auto) { n++; });
+        return n;
+    }
+    size_t radius(const position<D>& p, coord r) {
+        size_t n = 0;
+        k.for_each_item_within_radius(p, r, [&](auto) { n++; });
+        return n;
+    }
+    size_t knn(const position<D>& p, size_t n) {
+        return k.nearest(p, n).size();
+    }
+};
+
+//positions in a flat array scanned by every query
+template<size_t D>
+struct brute_index {
+    static constexpr unsigned ops = has_build | has_insert | has_move | has_remove | has_point | has_area | has_radius | has_knn;
+    static constexpr bool linear = true;
+    std::vector<position<D>> positions;
+    std::vector<uint32_t> ids;
+    flat::map<uint32_t, size_t> index;
+    std::vector<std::pair<double, size_t>> best;
+
+    static double distance2(const position<D>& a, const position<D>& b) {
+        double d2 = 0;
+        for (size_t i = 0; i < D; i++) {
+            double d = static_cast<double>(a[i]) - static_cast<double>(b[i]);
+            d2 += d * d;
+        }
+        return d2;
+    }
+    void build(const std::vector<position<D>>& ps) {
+        positions = ps;
+        ids.resize(ps.size());
+        index.reserve(ps.size());
+        for (uint32_t i = 0; i < ps.size(); i++) {
+            ids[i] = i;
+            index[i] = i;
+        }
+    }
+    void insert(uint32_t id, const position<D>& p) {
+        index[id] = positions.size();
+        positions.push_back(p);
+        ids.push_back(id);
+    }
+    void move(const std::vector<std::pair<uint32_t, position<D>>>& moves) {
+        for (auto& [id, p]: moves) {
+            positions[*index.find(id)] = p;
+        }
+    }
+    void remove(uint32_t id) {
+        size_t i = *index.find(id);
+        index.erase(id);
+        if (i + 1 != positions.size()) {
+            positions[i] = positions.back();
+            ids[i] = ids.back();
+            index[ids[i]] = i;
+        }
+        positions.pop_back();
+        ids.pop_back();
+    }
+    size_t point(const position<D>& p) {
+        return std::count(positions.begin(), positions.end(), p);
+    }
+    size_t area(const box<D>& b) {
+        size_t n = 0;
+        for (auto& p: positions) {
+            bool in = true;
+            for (size_t i = 0; i < D; i++) {
+                in &= p[i] >= b.min[i] && p[i] < b.max[i];
+            }
+            n += in;
+        }
+        return n;
+    }
+    size_t radius(const position<D>& c, coord r) {
+        double r2 = static_cast<double>(r) * static_cast<double>(r);
+        size_t n = 0;
+        for (auto& p: positions) {
+            n += distance2(p, c) <= r2;
+        }
+        return n;
+    }
+    size_t knn(const position<D>& c, size_t k) {
+        best.clear();
+        for (size_t i = 0; i < positions.size(); i++) {
+            double d2 = distance2(positions[i], c);
+            if (best.size() < k) {
+                best.push_back({d2, i});
+                std::push_heap(best.begin(), best.end());
+            } else if (d2 < best.front().first) {
+                std::pop_heap(best.begin(), best.end());
+                best.back() = {d2, i};
+                std::push_heap(best.begin(), best.end());
+            }
+        }
+        return best.size();
+    }
+};
+
+//uniform: anywhere in the world
+//clustered: normally distributed around the centre, as in test.cc
+//moving: clustered, each item walking towards its own target
+enum class workload {
+    uniform,
+    clustered,
+    moving,
+};
+constexpr const char* workload_names[] = {"uniform", "clustered", "moving"};
+
+template<size_t D>
+struct scene {
+    workload w;
+    std::mt19937_64 rng;
+    std::vector<position<D>> positions;
+    std::vector<position<D>> targets;
+
+    scene(workload w, size_t n, uint64_t seed): w(w), rng(seed) {
+        for (size_t i = 0; i < n; i++) {
+            positions.push_back(random_position());
+            targets.push_back(random_position());
+        }
+    }
+    position<D> random_position() {
+        position<D> p;
+        std::uniform_int_distribution<coord> uniform(0, world - 1);
+        std::normal_distribution<double> normal(world / 2, world / 64);
+        for (size_t i = 0; i < D; i++) {
+            p[i] = w == workload::uniform ? uniform(rng) : static_cast<coord>(std::clamp(normal(rng), 0.0, world - 1.0));
+        }
+        return p;
+    }
+    //one frame of movement: a walk of up to 4 per dimension towards the
+    //target for moving items, a small jitter otherwise
+    std::vector<std::pair<uint32_t, position<D>>> step() {
+        std::vector<std::pair<uint32_t, position<D>>> moves;
+        std::uniform_int_distribution<int> jitter(-4, 4);
+        for (uint32_t i = 0; i < positions.size(); i++) {
+            position<D>& p = positions[i];
+            for (size_t d = 0; d < D; d++) {
+                if (w == workload::moving) {
+                    coord gap = p[d] < targets[i][d] ? targets[i][d] - p[d] : p[d] - targets[i][d];
+                    coord s = std::min<coord>(gap, 4);
+                    p[d] = p[d] < targets[i][d] ? p[d] + s : p[d] - s;
+                } else {
+                    p[d] = static_cast<coord>(std::clamp<int64_t>(int64_t(p[d]) + jitter(rng), 0, world - 1));
+                }
+            }
+            if (w == workload::moving && p == targets[i]) {
+                targets[i] = random_position();
+            }
+            moves.push_back({i, p});
+        }
+        return moves;
+    }
+};
+
+struct row {
+    std::string index;
+    const char* workload;
+    size_t dimension;
+    size_t items;
+    const char* op;
+    double ns_per_op;
+    double hits_per_op;
+    size_t peak_bytes;
+    double bytes_per_item;
+};
+std::vector<row> rows;
+
+void report(row r) {
+    std::cout << std::left << std::setw(18) << r.index << std::setw(10) << r.workload << r.dimension << "d "
+              << std::right << std::setw(9) << r.items << "  " << std::left << std::setw(7) << r.op
+              << std::right << std::fixed << std::setprecision(1) << std::setw(12) << r.ns_per_op << " ns/op"
+              << std::setw(9) << r.hits_per_op << " hits";
+    if (r.peak_bytes != 0) {
+        std::cout << std::setw(12) << r.peak_bytes << " peak B" << std::setw(9) << r.bytes_per_item << " B/item";
+    }
+    std::cout << std::endl;
+    rows.push_back(r);
+}
+
+volatile size_t sink;
+
+template<typename Index, size_t D>
+void run(const std::string& name, workload w, size_t n) {
+    using clock = std::chrono::steady_clock;
+    auto ns_since = [](clock::time_point start) {
+        return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    };
+    scene<D> s(w, n, 0x5eed + n);
+    const char* wname = workload_names[static_cast<size_t>(w)];
+
+    memory::reset_peak();
+    size_t before = memory::current;
+    auto start = clock::now();
+    Index* index = new Index();
+    index->build(s.positions);
+    double ns = ns_since(start);
+    size_t retained = memory::current - before;
+    report({name, wname, D, n, "build", ns / n, 0, memory::peak - before, double(retained) / n});
+
+    //queries sized to hold about 16 uniform items, fewer of them for
+    //indexes that scan everything
+    size_t queries = Index::linear ? std::clamp<size_t>(20000000 / n, 1, 1000) : 10000;
+    double side = world * std::pow(16.0 / n, 1.0 / D);
+    coord r = static_cast<coord>(side / 2);
+    std::vector<position<D>> centres;
+    std::vector<box<D>> boxes;
+    for (size_t q = 0; q < queries; q++) {
+        //half the point queries land on an item
+        centres.push_back(q % 2 == 0 ? s.positions[s.rng() % n] : s.random_position());
+        box<D> b;
+        for (size_t i = 0; i < D; i++) {
+            b.min[i] = centres.back()[i] - std::min<coord>(centres.back()[i], side / 2);
+            b.max[i] = std::min<coord>(world, b.min[i] + static_cast<coord>(side));
+        }
+        boxes.push_back(b);
+    }
+    auto time_queries = [&](unsigned o, const char* oname, auto&& query) {
+        if ((Index::ops & o) == 0) {
+            return;
+        }
+        size_t hits = 0;
+        auto start = clock::now();
+        for (size_t q = 0; q < queries; q++) {
+            hits += query(q);
+        }
+        double ns = ns_since(start);
+        sink = hits;
+        report({name, wname, D, n, oname, ns / queries, double(hits) / queries, 0, 0});
+    };
+    time_queries(has_point, "point", [&](size_t q) { return index->point(centres[q]); });
+    time_queries(has_area, "box", [&](size_t q) { return index->area(boxes[q]); });
+    time_queries(has_radius, "radius", [&](size_t q) { return index->radius(centres[q], r); });
+    time_queries(has_knn, "knn", [&](size_t q) { return index->knn(centres[q], 8); });
+
+    if (Index::ops & has_move) {
+        //a few frames, each moving every item once
+        constexpr size_t frames = 3;
+        double ns = 0;
+        for (size_t f = 0; f < frames; f++) {
+            auto moves = s.step();
+            auto start = clock::now();
+            index->move(moves);
+            ns += ns_since(start);
+        }
+        report({name, wname, D, n, "move", ns / (frames * n), 0, 0, 0});
+    }
+    size_t extra = std::max<size_t>(1, n / 10);
+    if (Index::ops & has_insert) {
+        std::vector<position<D>> ps;
+        for (size_t i = 0; i < extra; i++) {
+            ps.push_back(s.random_position());
+        }
+        auto start = clock::now();
+        for (size_t i = 0; i < extra; i++) {
+            index->insert(n + i, ps[i]);
+        }
+        report({name, wname, D, n, "insert", ns_since(start) / extra, 0, 0, 0});
+    }
+    if (Index::ops & has_remove) {
+        auto start = clock::now();
+        for (size_t i = 0; i < extra; i++) {
+            index->remove(i * 7 % n);
+        }
+        report({name, wname, D, n, "remove", ns_since(start) / extra, 0, 0, 0});
+    }
+    delete index;
+}
+
+template<size_t D>
+void run_all(size_t n) {
+    for (workload w: {workload::uniform, workload::clustered, workload::moving}) {
+        run<tree_index<D, 16, tree::storage::pool>, D>("tree/pool/16", w, n);
+        run<tree_index<D, 64, tree::storage::pool>, D>("tree/pool/64", w, n);
+        run<tree_index<D, 64, tree::storage::array>, D>("tree/array/64", w, n);
+        run<tree_index<D, 64, tree::storage::vector>, D>("tree/vector/64", w, n);
+        run<list_index<D>, D>("list", w, n);
+        run<graph_index<D>, D>("graph", w, n);
+        run<kdtree_index<D>, D>("kdtree", w, n);
+        run<brute_index<D>, D>("brute", w, n);
+    }
+}
+
+int main(int argc, char** argv) {
+    size_t max_items = 100000;
+    std::string csv;
+    std::string json;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--max-items") {
+            max_items = std::stoull(argv[i + 1]);
+        } else if (arg == "--csv") {
+            csv = argv[i + 1];
+        } else if (arg == "--json") {
+            json = argv[i + 1];
+        } else {
+            std::cerr << "unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+    for (size_t n = 1000; n <= max_items; n *= 10) {
+        run_all<2>(n);
+        run_all<3>(n);
+    }
+
+    if (!csv.empty()) {
+        std::ofstream out(csv);
+        out << "index,workload,dimension,items,op,ns_per_op,hits_per_op,peak_bytes,bytes_per_item\n";
+        for (const row& r: rows) {
+            out << r.index << ',' << r.workload << ',' << r.dimension << ',' << r.items << ',' << r.op << ','
+                << r.ns_per_op << ',' << r.hits_per_op << ',' << r.peak_bytes << ',' << r.bytes_per_item << '\n';
+        }
+    }
+    if (!json.empty()) {
+        std::ofstream out(json);
+        out << "[\n";
+        for (size_t i = 0; i < rows.size(); i++) {
+            const row& r = rows[i];
+            out << "  {\"index\": \"" << r.index << "\", \"workload\": \"" << r.workload << "\", \"dimension\": " << r.dimension
+                << ", \"items\": " << r.items << ", \"op\": \"" << r.op << "\", \"ns_per_op\": " << r.ns_per_op
+                << ", \"hits_per_op\": " << r.hits_per_op << ", \"peak_bytes\": " << r.peak_bytes
+                << ", \"bytes_per_item\": " << r.bytes_per_item << "}" << (i + 1 < rows.size() ? "," : "") << "\n";
+        }
+        out << "]\n";
+    }
+    return 0;
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <utility>
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace flat {
+
+//open addressing hash map: one control byte per slot, holding 7 bits of
+//the hash for a full slot, scanned 16 at a time with SSE2
+//a lookup compares the control bytes of one group and then, almost
+//always, a single slot, instead of chasing a node per entry
+//slots move on rehash, so pointers from find last until the next insert
+//Vector holds the control bytes and the slots, anything indexable and
+//resizable whose elements are contiguous 16 at a time will do
+template<typename Key, typename Value, typename Hash = std::hash<Key>, template<typename> class Vector = std::vector>
+struct map {
+    constexpr const static size_t group_size = 16;
+    constexpr const static int8_t empty_slot = -128;
+    constexpr const static int8_t deleted_slot = -2;
+    using slot = std::pair<Key, Value>;
+
+    size_t size() const {
+        return count;
+    }
+    bool empty() const {
+        return count == 0;
+    }
+    void clear() {
+        for (size_t i = 0; i < control.size(); i++) {
+            control[i] = empty_slot;
+        }
+        count = 0;
+        tombstones = 0;
+    }
+    //heap bytes held by the control bytes and the slots
+    size_t bytes() const {
+        return control.size() + slots.size() * sizeof(slots[0]);
+    }
+    void reserve(size_t n) {
+        if (n > max_load(capacity())) {
+            rehash(n);
+        }
+    }
+
+    const Value* find(const Key& k) const {
+        if (count == 0) {
+            return nullptr;
+        }
+        size_t i = find_slot(k, hash(k));
+        return i == npos ? nullptr : &slots[i].second;
+    }
+    Value* find(const Key& k) {
+        return const_cast<Value*>(std::as_const(*this).find(k));
+    }
+    //the value for k, inserted default constructed if missing
+    Value& operator[](const Key& k) {
+        uint64_t h = hash(k);
+        if (count != 0) {
+            size_t i = find_slot(k, h);
+            if (i != npos) {
+                return slots[i].second;
+            }
+        }
+        if (count + tombstones + 1 > max_load(capacity())) {
+            //room for as many again, which also clears the tombstones
+            rehash(2 * (count + 1));
+        }
+        size_t i = free_slot(h);
+        if (control[i] == deleted_slot) {
+            tombstones--;
+        }
+        control[i] = h2(h);
+        slots[i] = {k, Value {}};
+        count++;
+        return slots[i].second;
+    }
+    bool erase(const Key& k) {
+        if (count == 0) {
+            return false;
+        }
+        size_t i = find_slot(k, hash(k));
+        if (i == npos) {
+            return false;
+        }
+        //a group that still has an empty slot never made a probe move on,
+        //so the slot can go straight back to empty
+        if (match(i / group_size, empty_slot) != 0) {
+            control[i] = empty_slot;
+        } else {
+            control[i] = deleted_slot;
+            tombstones++;
+        }
+        count--;
+        return true;
+    }
+    //the table as it is laid out, for storing it elsewhere and taking it
+    //back with adopt
+    const Vector<int8_t>& control_bytes() const {
+        return control;
+    }
+    const Vector<slot>& slot_array() const {
+        return slots;
+    }
+    size_t tombstone_count() const {
+        return tombstones;
+    }
+    static map adopt(Vector<int8_t> control, Vector<slot> slots, size_t count, size_t tombstones) {
+        map m;
+        m.control = std::move(control);
+        m.slots = std::move(slots);
+        m.count = count;
+        m.tombstones = tombstones;
+        return m;
+    }
+    //calls f(key, value) for every entry
+    template<typename F>
+    void for_each(F&& f) const {
+        for (size_t i = 0; i < control.size(); i++) {
+            if (control[i] >= 0) {
+                f(slots[i].first, slots[i].second);
+            }
+        }
+    }
+
+private:
+    constexpr const static size_t npos = -1;
+    Vector<int8_t> control;
+    Vector<slot> slots;
+    size_t count = 0;
+    size_t tombstones = 0;
+
+    size_t capacity() const {
+        return control.size();
+    }
+    static size_t max_load(size_t capacity) {
+        return capacity - capacity / 8;
+    }
+    //std::hash of an integer is the integer, mix it so both the group
+    //index and the 7 control bits are well spread
+    static uint64_t hash(const Key& k) {
+        uint64_t h = Hash {}(k);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccd;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53;
+        h ^= h >> 33;
+        return h;
+    }
+    static int8_t h2(uint64_t h) {
+        return h >> 57;
+    }
+    size_t num_groups() const {
+        return capacity() / group_size;
+    }
+    //bit j set where slot j of group g holds control byte b
+    uint32_t match(size_t g, int8_t b) const {
+        const int8_t* c = &control[g * group_size];
+#ifdef __SSE2__
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(c));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(b)));
+#else
+        uint32_t bits = 0;
+        for (size_t j = 0; j < group_size; j++) {
+            bits |= uint32_t{c[j] == b} << j;
+        }
+        return bits;
+#endif
+    }
+    //bit j set where slot j of group g is empty or deleted
+    uint32_t match_free(size_t g) const {
+        const int8_t* c = &control[g * group_size];
+#ifdef __SSE2__
+        return _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c)));
+#else
+        uint32_t bits = 0;
+        for (size_t j = 0; j < group_size; j++) {
+            bits |= uint32_t{c[j] < 0} << j;
+        }
+        return bits;
+#endif
+    }
+    //groups are probed in triangular steps, which visits every group of a
+    //power of two table, and a group with an empty slot ends the probe
+    size_t find_slot(const Key& k, uint64_t h) const {
+        size_t mask = num_groups() - 1;
+        size_t g = h & mask;
+        for (size_t step = 1; ; step++) {
+            for (uint32_t bits = match(g, h2(h)); bits != 0; bits &= bits - 1) {
+                size_t i = g * group_size + __builtin_ctz(bits);
+                if (slots[i].first == k) {
+                    return i;
+                }
+            }
+            if (match(g, empty_slot) != 0) {
+                return npos;
+            }
+            g = (g + step) & mask;
+        }
+    }
+    size_t free_slot(uint64_t h) const {
+        size_t mask = num_groups() - 1;
+        size_t g = h & mask;
+        for (size_t step = 1; ; step++) {
+            uint32_t bits = match_free(g);
+            if (bits != 0) {
+                return g * group_size + __builtin_ctz(bits);
+            }
+            g = (g + step) & mask;
+        }
+    }
+    void rehash(size_t n) {
+        size_t new_capacity = group_size;
+        while (max_load(new_capacity) < n) {
+            new_capacity *= 2;
+        }
+        Vector<int8_t> old_control;
+        Vector<slot> old_slots;
+        old_control.resize(new_capacity);
+        old_slots.resize(new_capacity);
+        for (size_t i = 0; i < new_capacity; i++) {
+            old_control[i] = empty_slot;
+        }
+        std::swap(old_control, control);
+        std::swap(old_slots, slots);
+        tombstones = 0;
+        for (size_t i = 0; i < old_control.size(); i++) {
+            if (old_control[i] >= 0) {
+                uint64_t h = hash(old_slots[i].first);
+                size_t j = free_slot(h);
+                control[j] = h2(h);
+                slots[j] = std::move(old_slots[i]);
+            }
+        }
+    }
+};
+
+}
@@ -1,14 +1,170 @@
+#pragma once
+
 #include <vector>
+#include <array>
 #include <optional>
 #include <algorithm>
+#include <iterator>
+#include <limits>
+#include <cmath>
+#include <cstdint>
+#include <cassert>
+
+#include "morton.hh"
+#include "flat_map.hh"
+#include "tree.hh"
 
 namespace graph {
 
+//rows of T laid out one after another in a single array, compressed sparse
+//row style, each row with its start, its size and the room it may grow in
+//a row that outgrows its room moves to the end of the array, and the room
+//it leaves is reclaimed once such gaps add up to half the array
+template<typename T>
+struct rows {
+    struct extent {
+        uint32_t begin = 0;
+        uint32_t size = 0;
+        uint32_t capacity = 0;
+    };
+    struct range {
+        const T* first;
+        const T* last;
+        const T* begin() const {
+            return first;
+        }
+        const T* end() const {
+            return last;
+        }
+        size_t size() const {
+            return last - first;
+        }
+        bool empty() const {
+            return first == last;
+        }
+        const T& operator[](size_t i) const {
+            return first[i];
+        }
+    };
+
+    std::vector<extent> extents;
+    std::vector<T> targets;
+    //entries of targets outside every row's room
+    size_t gaps = 0;
+
+    size_t size() const {
+        return extents.size();
+    }
+    range operator[](size_t r) const {
+        const extent& e = extents[r];
+        return {targets.data() + e.begin, targets.data() + e.begin + e.size};
+    }
+    void resize(size_t n) {
+        extents.resize(n);
+    }
+    //a new last row with no room to spare, for laying rows out in order
+    void append(const T* first, size_t n) {
+        extents.push_back({static_cast<uint32_t>(targets.size()), static_cast<uint32_t>(n), static_cast<uint32_t>(n)});
+        targets.insert(targets.end(), first, first + n);
+    }
+    void assign(size_t r, const std::vector<T>& row) {
+        reserve(r, row.size());
+        std::copy(row.begin(), row.end(), targets.begin() + extents[r].begin);
+        extents[r].size = row.size();
+    }
+    void push_back(size_t r, T t) {
+        reserve(r, extents[r].size + 1);
+        extent& e = extents[r];
+        targets[e.begin + e.size++] = t;
+    }
+    //removes t from row r, moving the row's last entry into its place
+    void erase(size_t r, T t) {
+        extent& e = extents[r];
+        T* first = targets.data() + e.begin;
+        T* found = std::find(first, first + e.size, t);
+        assert(found != first + e.size);
+        *found = first[--e.size];
+    }
+    //row t of the result lists every r whose row holds t, in order of r
+    static rows transpose(const rows& in, size_t n) {
+        rows out;
+        out.extents.resize(n);
+        for (const T& t: in.live_targets()) {
+            out.extents[t].capacity++;
+        }
+        uint32_t begin = 0;
+        for (extent& e: out.extents) {
+            e.begin = begin;
+            begin += e.capacity;
+        }
+        out.targets.resize(begin);
+        for (size_t r = 0; r < in.size(); r++) {
+            for (const T& t: in[r]) {
+                extent& e = out.extents[t];
+                out.targets[e.begin + e.size++] = r;
+            }
+        }
+        return out;
+    }
+    //every entry of every row
+    std::vector<T> live_targets() const {
+        std::vector<T> out;
+        for (size_t r = 0; r < size(); r++) {
+            out.insert(out.end(), (*this)[r].begin(), (*this)[r].end());
+        }
+        return out;
+    }
+
+private:
+    //room for n in row r
+    void reserve(size_t r, size_t n) {
+        extent& e = extents[r];
+        if (n <= e.capacity) {
+            return;
+        }
+        size_t begin = targets.size();
+        size_t capacity = n + n / 2;
+        targets.resize(begin + capacity);
+        std::copy(targets.begin() + e.begin, targets.begin() + e.begin + e.size, targets.begin() + begin);
+        gaps += e.capacity;
+        e.begin = begin;
+        e.capacity = capacity;
+        if (gaps > targets.size() / 2) {
+            compact();
+        }
+    }
+    //lays the rows out again in order, each keeping its room
+    void compact() {
+        std::vector<T> packed;
+        packed.reserve(targets.size() - gaps);
+        for (extent& e: extents) {
+            uint32_t begin = packed.size();
+            packed.insert(packed.end(), targets.begin() + e.begin, targets.begin() + e.begin + e.size);
+            packed.resize(begin + e.capacity);
+            e.begin = begin;
+        }
+        targets.swap(packed);
+        gaps = 0;
+    }
+};
+
+//proximity graph: every item is joined to the k items nearest it that lie
+//within distance r of it, either bound may be left open but not both
+//edges are rows of item ids, closest first, with the reverse rows kept
+//alongside so every item knows which rows hold it
+//a build sorts the items in morton order, so neighbours mostly have nearby
+//ids, and computes the rows of contiguous runs of them in parallel, each
+//run through its own cursor into a tree over the positions
+//after a change only the rows that can differ are computed again: those
+//of the items that changed, of the items whose rows held them, and of the
+//items whose reach, the distance to their last neighbour or r while they
+//have fewer than k, takes in a changed item's new position
 template<size_t Dimension, typename Coord, typename ID>
 struct graph {
-    using item_id = size_t;
+    using item_id = uint32_t;
     using your_id = ID;
     using Position = std::array<Coord, Dimension>;
+    constexpr const static size_t unbounded = std::numeric_limits<size_t>::max();
 
     struct item {
         Position pos;
@@ -32,78 +188,328 @@ struct graph {
         }
     };
 
-    std::vector<item> items;
-    std::unordered_map<your_id, item_id> index;
-
-    template<typename T>
-    static size_t msb(T t) {
-        if (t != 0) {
-            if constexpr (sizeof(t) == 4) {
-                return std::numeric_limits<T>::digits - 1 - __builtin_clzl(t);
-            } else if (sizeof(t) == 8) {
-                return std::numeric_limits<T>::digits - 1 - __builtin_clzll(t);
+    using space_type = tree::tree<Dimension, Coord, item_id>;
+    using curve = morton::curve<Dimension, Coord>;
+
+    explicit graph(size_t k = 8, Coord r = std::numeric_limits<Coord>::max()):
+        k(k),
+        r2(static_cast<double>(r) * static_cast<double>(r))
+    {
+        assert(k != unbounded || r != std::numeric_limits<Coord>::max());
+    }
+
+    void insert_items(std::vector<item>& is) {
+        insert_items(is, nullptr);
+    }
+    void insert_items(std::vector<item>& is, parallel::thread_pool& threads) {
+        insert_items(is, &threads);
+    }
+    item_id insert_item(your_id data, Position position) {
+        item_id x = allocate(item {position, data});
+        space.insert_item(x, position);
+        repair({x});
+        return x;
+    }
+    void update_positions(const std::vector<std::pair<your_id, Position>>& moves) {
+        std::vector<item_id> changed;
+        std::vector<std::pair<item_id, Position>> space_moves;
+        for (auto& [data, position]: moves) {
+            const item_id* search = index.find(data);
+            if (search == nullptr) {
+                continue;
             }
-        } else {
-            return std::numeric_limits<T>::digits;
+            items[*search].pos = position;
+            changed.push_back(*search);
+            space_moves.push_back({*search, position});
+        }
+        space.update_positions(space_moves);
+        repair(changed);
+    }
+    void remove_item(your_id data) {
+        const item_id* search = index.find(data);
+        if (search == nullptr) {
+            return;
+        }
+        item_id x = *search;
+        index.erase(data);
+        live[x] = false;
+        space.remove_item(*space.find_item(x));
+        repair({x});
+        free_items.push_back(x);
+    }
+
+    std::optional<Position> find_item(your_id data) const {
+        const item_id* search = index.find(data);
+        if (search == nullptr) {
+            return std::nullopt;
         }
+        return items[*search].pos;
+    }
+    const item& get_item(item_id i) const {
+        return items[i];
     }
-    static size_t highest_bit_different(Position a, Position b) {
-        Coord bits = 0;
-        for (size_t i = 0; i < Dimension; i++)
-            bits |= a[i] ^ b[i];
-        return msb(bits);
+    size_t size() const {
+        return index.size();
     }
-    static bool morton_compare(const Position &a, const Position &b) {
-        size_t bit = highest_bit_different(a, b);
-        size_t bits_a = 0;
-        size_t bits_b = 0;
-        for (size_t i = 0; i < Dimension; i++) {
-            bits_a <<= 1;
-            bits_b <<= 1;
-            bits_a |= (a[i] >> bit) & 1;
-            bits_b |= (b[i] >> bit) & 1;
+    size_t num_edges() const {
+        size_t n = 0;
+        for (size_t x = 0; x < out.size(); x++) {
+            n += out[x].size();
         }
-        return bits_a < bits_b;
+        return n;
     }
-    static bool morton_compare2(const item& a, const item& b) {
-        return morton_compare(a.pos, b.pos);
+    //the item ids joined to item i, closest first
+    typename rows<item_id>::range neighbours(item_id i) const {
+        return out[i];
+    }
+    //calls f(const item&) for every neighbour of the item with id data,
+    //closest first
+    template<typename F>
+    void for_each_neighbour(your_id data, F&& f) const {
+        const item_id* search = index.find(data);
+        if (search == nullptr) {
+            return;
+        }
+        for (item_id y: out[*search]) {
+            f(items[y]);
+        }
     }
 
-    void insert_items(std::vector<item>& is) {
-        std::sort(is.begin(), is.end(), morton_compare2);
-        auto middle = items.end();
-        items.insert(
-            items.end(),
-            std::make_move_iterator(is.begin()),
-            std::make_move_iterator(is.end())
-        );
-        std::inplace_merge(items.begin(), middle, items.end(), morton_compare2);
-    }
-    void insert_item(your_id data, Position position) {
-        items.push_back(std::move(item{position, data}));
-        std::sort(items.begin(), items.end(), morton_compare2);
-    }
-
-    std::optional<Position> find_item(your_id data) {
-        auto search = index.find(data);
-        if (search != index.end()) {
-            return items[search->second].pos;
-        } else {
-            return std::nullopt;
+    //every row matches one computed afresh, up to ties, and the reverse
+    //rows match the rows
+    void post_insert_check() const {
+        space.post_insert_check();
+        scratch s;
+        std::vector<item_id> row;
+        size_t edges = 0;
+        for (item_id x = 0; x < items.size(); x++) {
+            if (!live[x]) {
+                assert(out[x].empty() && in[x].empty());
+                continue;
+            }
+            assert(*index.find(items[x].id) == x);
+            double reach = compute_row(s, x, row);
+            assert(reach == reach2[x] && reach <= max_reach2);
+            assert(row.size() == out[x].size());
+            for (size_t j = 0; j < row.size(); j++) {
+                item_id y = out[x][j];
+                assert(live[y] && y != x);
+                assert(distance2(x, y) == distance2(x, row[j]));
+                assert(std::count(in[y].begin(), in[y].end(), x) == 1);
+            }
+            edges += row.size();
+        }
+        size_t reverse_edges = 0;
+        for (item_id y = 0; y < items.size(); y++) {
+            reverse_edges += in[y].size();
         }
+        assert(edges == reverse_edges);
     }
 
-    std::optional<your_id> find_item(Position position) {
-        if (!items.empty()) {
-            auto search = std::lower_bound(items.begin(), items.end(), morton_compare2);
-            if (search->pos == position) {
-                return {search->id};
+private:
+    size_t k;
+    double r2;
+    std::vector<item> items;
+    std::vector<bool> live;
+    std::vector<item_id> free_items;
+    flat::map<your_id, item_id> index;
+    space_type space;
+    //out[x] holds the neighbours of x, in[y] every x whose row holds y
+    rows<item_id> out;
+    rows<item_id> in;
+    //the squared reach of every item, and no less than the largest of them,
+    //it is not lowered as reaches shrink until the next build
+    std::vector<double> reach2;
+    double max_reach2 = 0;
+    //reaches beyond this are taken as the whole space
+    constexpr const static Coord far = Coord{1} << (std::numeric_limits<Coord>::digits - 2);
+
+    //what one thread needs to compute rows
+    struct scratch {
+        typename space_type::cursor c;
+        std::vector<typename space_type::item_id> found;
+        std::vector<std::pair<double, item_id>> near;
+    };
+
+    double distance2(item_id a, item_id b) const {
+        return space_type::distance2(items[a].pos, items[b].pos);
+    }
+    //calls f(y, d2) for every item y no further than sqrt(reach) from p
+    template<typename F>
+    void for_each_within(scratch& s, const Position& p, double reach, F&& f) const {
+        if (reach >= static_cast<double>(far) * static_cast<double>(far)) {
+            for (item_id y = 0; y < items.size(); y++) {
+                double d2 = space_type::distance2(p, items[y].pos);
+                if (live[y] && d2 <= reach) {
+                    f(y, d2);
+                }
+            }
+            return;
+        }
+        Coord radius = static_cast<Coord>(std::ceil(std::sqrt(reach)));
+        space.for_each_item_within_radius(s.c, p, radius, [&](typename space_type::item_id t) {
+            item_id y = space.get_item(t).id;
+            double d2 = space_type::distance2(p, items[y].pos);
+            if (d2 <= reach) {
+                f(y, d2);
+            }
+        });
+    }
+    //the row of x by the queries, returns its reach
+    double compute_row(scratch& s, item_id x, std::vector<item_id>& row) const {
+        row.clear();
+        const Position& p = items[x].pos;
+        if (k == unbounded) {
+            s.near.clear();
+            for_each_within(s, p, r2, [&](item_id y, double d2) {
+                if (y != x) {
+                    s.near.push_back({d2, y});
+                }
+            });
+            std::sort(s.near.begin(), s.near.end());
+            for (auto& n: s.near) {
+                row.push_back(n.second);
+            }
+            return r2;
+        }
+        //one more than k, as x finds itself
+        s.found.clear();
+        space.nearest(s.c, p, k + 1, std::back_inserter(s.found));
+        for (auto t: s.found) {
+            item_id y = space.get_item(t).id;
+            if (y != x && row.size() < k && distance2(x, y) <= r2) {
+                row.push_back(y);
             }
         }
-        return std::nullopt;
+        return row.size() == k ? distance2(x, row.back()) : r2;
     }
 
-    void post_insert_check() {
+    void insert_items(std::vector<item>& is, parallel::thread_pool* threads) {
+        if (!items.empty()) {
+            std::vector<item_id> added;
+            std::vector<typename space_type::item> placed;
+            for (auto& i: is) {
+                Position p = i.pos;
+                item_id x = allocate(std::move(i));
+                added.push_back(x);
+                placed.push_back({p, x, 0});
+            }
+            space.insert_items(placed);
+            repair(added);
+            return;
+        }
+        if (threads != nullptr) {
+            curve::sort(is, [](const item& i) { return i.pos; }, *threads);
+        } else {
+            curve::sort(is, [](const item& i) { return i.pos; });
+        }
+        std::vector<typename space_type::item> placed;
+        for (auto& i: is) {
+            placed.push_back({i.pos, static_cast<item_id>(items.size()), 0});
+            allocate(std::move(i));
+        }
+        if (threads != nullptr) {
+            space.insert_items(placed, *threads);
+        } else {
+            space.insert_items(placed);
+        }
+
+        //each run of items lays out its rows on its own, then they are
+        //joined in order
+        size_t n = items.size();
+        size_t num_runs = threads != nullptr ? std::max<size_t>(1, std::min(n, threads->size() * 4)) : 1;
+        std::vector<rows<item_id>> runs(num_runs);
+        auto build_run = [&](size_t c) {
+            scratch s;
+            std::vector<item_id> row;
+            for (size_t x = n * c / num_runs; x < n * (c + 1) / num_runs; x++) {
+                reach2[x] = compute_row(s, x, row);
+                runs[c].append(row.data(), row.size());
+            }
+        };
+        if (threads != nullptr) {
+            threads->parallel_for(num_runs, build_run);
+        } else {
+            build_run(0);
+        }
+        out = {};
+        for (auto& run: runs) {
+            for (size_t x = 0; x < run.size(); x++) {
+                out.append(run[x].begin(), run[x].size());
+            }
+        }
+        in = rows<item_id>::transpose(out, n);
+        max_reach2 = n == 0 ? 0 : *std::max_element(reach2.begin(), reach2.end());
+    }
+    item_id allocate(item&& i) {
+        item_id x;
+        if (!free_items.empty()) {
+            x = free_items.back();
+            free_items.pop_back();
+        } else {
+            x = items.size();
+            items.emplace_back();
+            live.push_back(false);
+            reach2.push_back(0);
+            out.resize(x + 1);
+            in.resize(x + 1);
+        }
+        index[i.id] = x;
+        items[x] = std::move(i);
+        live[x] = true;
+        return x;
+    }
+    //makes the rows right again after the items changed were moved,
+    //inserted or removed
+    void repair(const std::vector<item_id>& changed) {
+        scratch s;
+        std::vector<item_id> affected;
+        for (item_id m: changed) {
+            affected.insert(affected.end(), in[m].begin(), in[m].end());
+            if (live[m]) {
+                affected.push_back(m);
+                for_each_within(s, items[m].pos, max_reach2, [&](item_id y, double d2) {
+                    if (d2 <= reach2[y]) {
+                        affected.push_back(y);
+                    }
+                });
+            }
+        }
+        std::sort(affected.begin(), affected.end());
+        affected.erase(std::unique(affected.begin(), affected.end()), affected.end());
+        std::vector<item_id> row;
+        for (item_id x: affected) {
+            if (live[x]) {
+                reach2[x] = compute_row(s, x, row);
+                max_reach2 = std::max(max_reach2, reach2[x]);
+                set_row(x, row);
+            }
+        }
+        row.clear();
+        for (item_id m: changed) {
+            if (!live[m]) {
+                set_row(m, row);
+                assert(in[m].empty());
+            }
+        }
+    }
+    //replaces the row of x, and x in the reverse rows to match
+    void set_row(item_id x, const std::vector<item_id>& row) {
+        std::vector<item_id> before(out[x].begin(), out[x].end());
+        std::vector<item_id> after(row);
+        std::sort(before.begin(), before.end());
+        std::sort(after.begin(), after.end());
+        std::vector<item_id> changes;
+        std::set_difference(before.begin(), before.end(), after.begin(), after.end(), std::back_inserter(changes));
+        for (item_id y: changes) {
+            in.erase(y, x);
+        }
+        changes.clear();
+        std::set_difference(after.begin(), after.end(), before.begin(), before.end(), std::back_inserter(changes));
+        for (item_id y: changes) {
+            in.push_back(y, x);
+        }
+        out.assign(x, row);
     }
 };
 
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <array>
+#include <limits>
+#include <cstdint>
+
+#include "morton.hh"
+
+namespace hilbert {
+
+//one level of Hamilton's algorithm ("Compact Hilbert indices", 2006): a
+//cell's orientation is its entry corner e and direction d, packed as the
+//state e * Dimension + d, l is the bit of every coordinate at this level,
+//dimension i at bit i; gives the key digit of l and the state of its child
+struct step_result {
+    uint32_t digit;
+    uint32_t state;
+};
+template<size_t Dimension>
+constexpr uint32_t rotate_right(uint32_t x, size_t r) {
+    constexpr uint32_t mask = (uint32_t{1} << Dimension) - 1;
+    r %= Dimension;
+    return ((x >> r) | (x << (Dimension - r))) & mask;
+}
+template<size_t Dimension>
+constexpr uint32_t rotate_left(uint32_t x, size_t r) {
+    constexpr uint32_t mask = (uint32_t{1} << Dimension) - 1;
+    r %= Dimension;
+    return ((x << r) | (x >> (Dimension - r))) & mask;
+}
+template<size_t Dimension>
+constexpr step_result step(uint32_t state, uint32_t l) {
+    uint32_t e = state / Dimension;
+    uint32_t d = state % Dimension;
+    uint32_t t = rotate_right<Dimension>(l ^ e, d + 1);
+    //inverse gray code
+    uint32_t w = t;
+    for (size_t s = 1; s < Dimension; s++) {
+        w ^= t >> s;
+    }
+    //the entry corner and direction of child w
+    uint32_t trailing = 0;
+    for (uint32_t b = w % 2 == 0 && w != 0 ? w - 1 : w; b & 1; b >>= 1) {
+        trailing++;
+    }
+    uint32_t entry = w == 0 ? 0 : (2 * ((w - 1) / 2)) ^ ((2 * ((w - 1) / 2)) >> 1);
+    uint32_t direction = w == 0 ? 0 : trailing % Dimension;
+    e ^= rotate_left<Dimension>(entry, d + 1);
+    d = (d + direction + 1) % Dimension;
+    return {w, static_cast<uint32_t>(e * Dimension + d)};
+}
+//levels steps at once: entry [state << (levels * Dimension) | digits]
+//holds the key digits in its low byte and the state after them above it
+template<size_t Dimension, size_t levels>
+constexpr auto make_table() {
+    constexpr size_t num_states = (size_t{1} << Dimension) * Dimension;
+    constexpr size_t bits = levels * Dimension;
+    std::array<uint16_t, (num_states << bits)> table {};
+    for (uint32_t s = 0; s < num_states; s++) {
+        for (uint32_t in = 0; in < (uint32_t{1} << bits); in++) {
+            uint32_t state = s;
+            uint32_t out = 0;
+            for (size_t j = levels; j-- > 0;) {
+                step_result r = step<Dimension>(state, (in >> (j * Dimension)) & ((uint32_t{1} << Dimension) - 1));
+                out |= r.digit << (j * Dimension);
+                state = r.state;
+            }
+            table[s << bits | in] = out | state << 8;
+        }
+    }
+    return table;
+}
+
+//hilbert curve over the low Bits bits of each coordinate, keys laid out
+//as morton::curve lays them out, so the same sorts and cell ranges apply
+//unlike morton order it never jumps between cells that do not touch, so
+//items close in key are close in space
+//encode interleaves the coordinates as morton does, then maps the digit of
+//each level to its hilbert digit from the top, through a table of several
+//levels at a time for 2 and 3 dimensions
+template<size_t Dimension, typename Coord, size_t Bits = std::numeric_limits<Coord>::digits>
+struct curve: morton::keys<curve<Dimension, Coord, Bits>, Dimension, Coord, Bits> {
+    using base = morton::keys<curve, Dimension, Coord, Bits>;
+    using typename base::Position;
+    using typename base::key;
+    using base::levels_per_word;
+    using base::num_words;
+    using interleave = morton::curve<Dimension, Coord, Bits>;
+    //the children of a cell come in an order that depends on the cell
+    static constexpr bool index_order = false;
+
+    static constexpr size_t num_states = (size_t{1} << Dimension) * Dimension;
+    static constexpr size_t levels_per_lookup = Dimension == 2 ? 4 : Dimension == 3 ? 2 : 1;
+    static constexpr bool use_table = num_states <= 256 && (num_states << (levels_per_lookup * Dimension)) <= (size_t{1} << 16);
+    static constexpr auto table = make_table<Dimension, use_table ? levels_per_lookup : 0>();
+    static constexpr auto single = make_table<Dimension, use_table ? 1 : 0>();
+
+    static key encode(const Position& p) {
+        constexpr uint64_t digit_mask = (uint64_t{1} << Dimension) - 1;
+        constexpr size_t lookup_bits = levels_per_lookup * Dimension;
+        auto m = interleave::encode(p);
+        key h {};
+        uint32_t state = 0;
+        for (size_t w = 0; w < num_words; w++) {
+            size_t levels = std::min(levels_per_word, Bits - (num_words - 1 - w) * levels_per_word);
+            uint64_t in = m.words[w];
+            uint64_t out = 0;
+            size_t j = levels;
+            if constexpr (use_table) {
+                for (; j >= levels_per_lookup; j -= levels_per_lookup) {
+                    size_t shift = (j - levels_per_lookup) * Dimension;
+                    uint16_t e = table[state << lookup_bits | ((in >> shift) & ((uint64_t{1} << lookup_bits) - 1))];
+                    out |= uint64_t{e & 0xffu} << shift;
+                    state = e >> 8;
+                }
+                while (j-- > 0) {
+                    uint16_t e = single[state << Dimension | ((in >> (j * Dimension)) & digit_mask)];
+                    out |= uint64_t{e & 0xffu} << (j * Dimension);
+                    state = e >> 8;
+                }
+            }
+            while (j-- > 0) {
+                step_result r = step<Dimension>(state, (in >> (j * Dimension)) & digit_mask);
+                out |= uint64_t{r.digit} << (j * Dimension);
+                state = r.state;
+            }
+            h.words[w] = out;
+        }
+        return h;
+    }
+    static bool compare(const Position& a, const Position& b) {
+        return encode(a) < encode(b);
+    }
+};
+
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <optional>
+#include <algorithm>
+#include <limits>
+#include <cstdint>
+
+namespace kdtree {
+
+//static k-d tree, a baseline for the other indexes: items are reordered
+//in place so the middle of every range splits it on one dimension, cycling
+//through the dimensions by depth, with no nodes stored at all
+//ranges of leaf_size items or fewer are scanned
+template<size_t Dimension, typename Coord, typename ID, size_t leaf_size = 8>
+struct kdtree {
+    using item_id = size_t;
+    using your_id = ID;
+    using Position = std::array<Coord, Dimension>;
+
+    struct item {
+        Position pos;
+        your_id id;
+    };
+    struct area {
+        Position min; //inclusive
+        Position max; //exclusive
+        bool contains(const Position& p) const {
+            for (size_t i = 0; i < Dimension; i++)
+                if (p[i] < min[i] || p[i] >= max[i])
+                    return false;
+            return true;
+        }
+    };
+
+    std::vector<item> items;
+
+    static double distance2(const Position& a, const Position& b) {
+        double d2 = 0;
+        for (size_t i = 0; i < Dimension; i++) {
+            Coord d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+            d2 += static_cast<double>(d) * static_cast<double>(d);
+        }
+        return d2;
+    }
+
+    void build(std::vector<item> is) {
+        items = std::move(is);
+        build(0, items.size(), 0);
+    }
+    const item& get_item(item_id i) const {
+        return items[i];
+    }
+
+    std::optional<your_id> find_item(Position position) const {
+        std::optional<your_id> found;
+        area a;
+        for (size_t i = 0; i < Dimension; i++) {
+            a.min[i] = position[i];
+            a.max[i] = position[i] + 1;
+        }
+        for_each_item_within_area(a, [&](item_id i) {
+            if (!found) {
+                found = items[i].id;
+            }
+        });
+        return found;
+    }
+    //calls f(item_id) for every item inside a
+    template<typename F>
+    void for_each_item_within_area(const area& a, F&& f) const {
+        visit(0, items.size(), 0, [&](size_t dim, Coord split) {
+            return std::pair {a.min[dim] <= split, split < a.max[dim]};
+        }, [&](item_id i) {
+            if (a.contains(items[i].pos)) {
+                f(i);
+            }
+        });
+    }
+    //calls f(item_id) for every item within distance r of position
+    template<typename F>
+    void for_each_item_within_radius(Position position, Coord r, F&& f) const {
+        double r2 = static_cast<double>(r) * static_cast<double>(r);
+        visit(0, items.size(), 0, [&](size_t dim, Coord split) {
+            return std::pair {position[dim] <= split || position[dim] - split <= r, split <= position[dim] || split - position[dim] <= r};
+        }, [&](item_id i) {
+            if (distance2(items[i].pos, position) <= r2) {
+                f(i);
+            }
+        });
+    }
+    //the ids of the k items closest to position, closest first
+    std::vector<item_id> nearest(Position position, size_t k) const {
+        std::vector<std::pair<double, item_id>> best;
+        if (k != 0) {
+            nearest(0, items.size(), 0, position, k, best);
+        }
+        std::sort_heap(best.begin(), best.end());
+        std::vector<item_id> out;
+        for (auto& b: best) {
+            out.push_back(b.second);
+        }
+        return out;
+    }
+
+private:
+    void build(size_t first, size_t last, size_t depth) {
+        if (last - first <= leaf_size) {
+            return;
+        }
+        size_t dim = depth % Dimension;
+        size_t mid = first + (last - first) / 2;
+        std::nth_element(items.begin() + first, items.begin() + mid, items.begin() + last, [dim](const item& a, const item& b) {
+            return a.pos[dim] < b.pos[dim];
+        });
+        build(first, mid, depth + 1);
+        build(mid + 1, last, depth + 1);
+    }
+    //every item left of the middle is <= it on the split dimension and
+    //every item right of it >=, side(dim, split) says which to enter
+    template<typename Side, typename F>
+    void visit(size_t first, size_t last, size_t depth, const Side& side, const F& f) const {
+        if (last - first <= leaf_size) {
+            for (size_t i = first; i < last; i++) {
+                f(i);
+            }
+            return;
+        }
+        size_t dim = depth % Dimension;
+        size_t mid = first + (last - first) / 2;
+        auto [left, right] = side(dim, items[mid].pos[dim]);
+        if (left) {
+            visit(first, mid, depth + 1, side, f);
+        }
+        f(mid);
+        if (right) {
+            visit(mid + 1, last, depth + 1, side, f);
+        }
+    }
+    void nearest(size_t first, size_t last, size_t depth, const Position& position, size_t k, std::vector<std::pair<double, item_id>>& best) const {
+        auto consider = [&](item_id i) {
+            double d2 = distance2(items[i].pos, position);
+            if (best.size() < k) {
+                best.push_back({d2, i});
+                std::push_heap(best.begin(), best.end());
+            } else if (d2 < best.front().first) {
+                std::pop_heap(best.begin(), best.end());
+                best.back() = {d2, i};
+                std::push_heap(best.begin(), best.end());
+            }
+        };
+        if (last - first <= leaf_size) {
+            for (size_t i = first; i < last; i++) {
+                consider(i);
+            }
+            return;
+        }
+        size_t dim = depth % Dimension;
+        size_t mid = first + (last - first) / 2;
+        Coord split = items[mid].pos[dim];
+        bool left_first = position[dim] <= split;
+        double gap = static_cast<double>(left_first ? split - position[dim] : position[dim] - split);
+        //the near side first, the far side only if the split plane is
+        //closer than the k-th best so far
+        if (left_first) {
+            nearest(first, mid, depth + 1, position, k, best);
+        } else {
+            nearest(mid + 1, last, depth + 1, position, k, best);
+        }
+        consider(mid);
+        if (best.size() < k || gap * gap <= best.front().first) {
+            if (left_first) {
+                nearest(mid + 1, last, depth + 1, position, k, best);
+            } else {
+                nearest(first, mid, depth + 1, position, k, best);
+            }
+        }
+    }
+};
+
+}
@@ -1,10 +1,22 @@
+#pragma once
+
 #include <vector>
+#include <array>
 #include <optional>
 #include <algorithm>
+#include <iterator>
+#include <cassert>
+
+#include "morton.hh"
+#include "flat_map.hh"
 
 namespace list {
 
-template<size_t Dimension, typename Coord, typename ID>
+//linear (pointerless) octree: items sorted by morton key in one array
+//a lookup table indexed by the key bits just below the prefix shared by
+//all keys narrows each binary search to a small window
+//lookup_bits = 0 disables the table
+template<size_t Dimension, typename Coord, typename ID, size_t lookup_bits = 12>
 struct list {
     using item_id = size_t;
     using your_id = ID;
@@ -32,78 +44,297 @@ struct list {
         }
     };
 
+    struct area {
+        Position min; //inclusive
+        Position max; //exclusive
+        bool contains(Position p) const {
+            for (size_t i = 0; i < Dimension; i++)
+                if (p[i] < min[i] || p[i] >= max[i])
+                    return false;
+            return true;
+        }
+    };
+
+    using curve = morton::curve<Dimension, Coord>;
+    using key = typename curve::key;
+
+    //main sorted array
     std::vector<item> items;
-    std::unordered_map<your_id, item_id> index;
-
-    template<typename T>
-    static size_t msb(T t) {
-        if (t != 0) {
-            if constexpr (sizeof(t) == 4) {
-                return std::numeric_limits<T>::digits - 1 - __builtin_clzl(t);
-            } else if (sizeof(t) == 8) {
-                return std::numeric_limits<T>::digits - 1 - __builtin_clzll(t);
+    std::vector<key> keys;
+    flat::map<your_id, item_id> index;
+
+    //recent inserts, log structured: single inserts go into a small sorted
+    //buffer, full buffers become runs that are merged with their neighbour
+    //once it is no more than twice their size, and the oldest run is merged
+    //into the main array once it reaches half its size
+    //item_ids count through the main array, the runs and then the buffer,
+    //so a merge of two neighbours leaves every other item_id unchanged
+    struct run {
+        std::vector<item> items;
+        std::vector<key> keys;
+    };
+    static constexpr size_t buffer_size = 64;
+    std::vector<run> runs;
+    run buffer;
+
+    //lookup[b] is the first item whose key has bits b at lookup_low
+    std::vector<item_id> lookup;
+    size_t lookup_low = 0;
+
+    static bool morton_compare(const Position &a, const Position &b) {
+        return curve::compare(a, b);
+    }
+    static bool morton_compare2(const item& a, const item& b) {
+        return morton_compare(a.pos, b.pos);
+    }
+
+    void rebuild_lookup() {
+        if constexpr (lookup_bits != 0) {
+            lookup.assign((size_t{1} << lookup_bits) + 1, 0);
+            if (keys.empty()) {
+                return;
+            }
+            size_t hb = curve::highest_bit_different(keys.front(), keys.back());
+            size_t prefix_low = hb == static_cast<size_t>(-1) ? 0 : hb + 1;
+            lookup_low = prefix_low > lookup_bits ? prefix_low - lookup_bits : 0;
+            for (const key& k: keys) {
+                lookup[curve::extract(k, lookup_low, lookup_bits) + 1]++;
+            }
+            for (size_t b = 1; b < lookup.size(); b++) {
+                lookup[b] += lookup[b - 1];
             }
-        } else {
-            return std::numeric_limits<T>::digits;
         }
     }
-    static size_t highest_bit_different(Position a, Position b) {
-        Coord bits = 0;
-        for (size_t i = 0; i < Dimension; i++)
-            bits |= a[i] ^ b[i];
-        return msb(bits);
+    //the range of the main array that can hold the lower bound of k
+    std::pair<item_id, item_id> search_window(const key& k) const {
+        if (lookup.empty() || keys.empty()) {
+            return {0, keys.size()};
+        }
+        if (k < keys.front()) {
+            return {0, 0};
+        }
+        if (keys.back() < k) {
+            return {keys.size(), keys.size()};
+        }
+        size_t b = curve::extract(k, lookup_low, lookup_bits);
+        return {lookup[b], lookup[b + 1]};
     }
-    static bool morton_compare(const Position &a, const Position &b) {
-        size_t bit = highest_bit_different(a, b);
-        size_t bits_a = 0;
-        size_t bits_b = 0;
-        for (size_t i = 0; i < Dimension; i++) {
-            bits_a <<= 1;
-            bits_b <<= 1;
-            bits_a |= (a[i] >> bit) & 1;
-            bits_b |= (b[i] >> bit) & 1;
+    item_id lower_bound(const key& k) const {
+        auto [first, last] = search_window(k);
+        return std::lower_bound(keys.begin() + first, keys.begin() + last, k) - keys.begin();
+    }
+    //lower bound of k in ks at or after from, galloping since box queries
+    //mostly skip a short distance
+    static item_id lower_bound_from(const std::vector<key>& ks, item_id from, const key& k) {
+        size_t step = 1;
+        while (from + step < ks.size() && ks[from + step] < k) {
+            step *= 2;
         }
-        return bits_a < bits_b;
+        return std::lower_bound(ks.begin() + from + step / 2, ks.begin() + std::min(from + step, ks.size()), k) - ks.begin();
     }
-    static bool morton_compare2(const item& a, const item& b) {
-        return morton_compare(a.pos, b.pos);
+
+    //calls f(run) for each run and then the buffer, in item_id order
+    template<typename F>
+    void for_each_run(F&& f) const {
+        for (const run& r: runs) {
+            f(r);
+        }
+        f(buffer);
+    }
+    size_t size() const {
+        size_t n = items.size() + buffer.items.size();
+        for (const run& r: runs) {
+            n += r.items.size();
+        }
+        return n;
+    }
+    //merges the sorted b into the sorted a, which starts at item_id base
+    //the items of b are moved from
+    void merge_runs(std::vector<item>& a_items, std::vector<key>& a_keys, std::vector<item>& b_items, std::vector<key>& b_keys, item_id base) {
+        std::vector<item> merged_items;
+        std::vector<key> merged_keys;
+        merged_items.reserve(a_items.size() + b_items.size());
+        merged_keys.reserve(a_items.size() + b_items.size());
+        size_t a = 0;
+        size_t b = 0;
+        while (a < a_items.size() || b < b_items.size()) {
+            if (b == b_items.size() || (a < a_items.size() && !(b_keys[b] < a_keys[a]))) {
+                merged_items.push_back(std::move(a_items[a]));
+                merged_keys.push_back(a_keys[a]);
+                a++;
+            } else {
+                merged_items.push_back(std::move(b_items[b]));
+                merged_keys.push_back(b_keys[b]);
+                b++;
+            }
+        }
+        a_items.swap(merged_items);
+        a_keys.swap(merged_keys);
+        for (size_t i = 0; i < a_items.size(); i++) {
+            index[a_items[i].id] = base + i;
+        }
+    }
+    void flush_buffer() {
+        runs.push_back(std::move(buffer));
+        buffer = {};
+        item_id base = size() - runs.back().items.size();
+        while (runs.size() >= 2 && runs[runs.size() - 2].items.size() <= 2 * runs.back().items.size()) {
+            run& a = runs[runs.size() - 2];
+            run& b = runs.back();
+            base -= a.items.size();
+            merge_runs(a.items, a.keys, b.items, b.keys, base);
+            runs.pop_back();
+        }
+        if (2 * runs.front().items.size() >= items.size()) {
+            merge_runs(items, keys, runs.front().items, runs.front().keys, 0);
+            runs.erase(runs.begin());
+            rebuild_lookup();
+        }
+    }
+    //merges every run and the buffer into the main array
+    void compact() {
+        for (run& r: runs) {
+            merge_runs(items, keys, r.items, r.keys, 0);
+        }
+        runs.clear();
+        merge_runs(items, keys, buffer.items, buffer.keys, 0);
+        buffer = {};
+        rebuild_lookup();
     }
 
     void insert_items(std::vector<item>& is) {
-        std::sort(is.begin(), is.end(), morton_compare2);
-        auto middle = items.end();
-        items.insert(
-            items.end(),
-            std::make_move_iterator(is.begin()),
-            std::make_move_iterator(is.end())
-        );
-        std::inplace_merge(items.begin(), middle, items.end(), morton_compare2);
+        compact();
+        std::vector<key> is_keys = curve::sort(is, [](const item& i) { return i.pos; });
+        merge_runs(items, keys, is, is_keys, 0);
+        rebuild_lookup();
     }
     void insert_item(your_id data, Position position) {
-        items.push_back(std::move(item{position, data}));
-        std::sort(items.begin(), items.end(), morton_compare2);
+        key k = curve::encode(position);
+        item_id i = std::upper_bound(buffer.keys.begin(), buffer.keys.end(), k) - buffer.keys.begin();
+        buffer.items.insert(buffer.items.begin() + i, item{position, data});
+        buffer.keys.insert(buffer.keys.begin() + i, k);
+        item_id base = size() - buffer.items.size();
+        for (; i < buffer.items.size(); i++) {
+            index[buffer.items[i].id] = base + i;
+        }
+        if (buffer.items.size() == buffer_size) {
+            flush_buffer();
+        }
     }
 
-    std::optional<Position> find_item(your_id data) {
-        auto search = index.find(data);
-        if (search != index.end()) {
-            return items[search->second].pos;
+    std::optional<Position> find_item(your_id data) const {
+        const item_id* search = index.find(data);
+        if (search != nullptr) {
+            return get_item(*search).pos;
         } else {
             return std::nullopt;
         }
     }
 
-    std::optional<your_id> find_item(Position position) {
-        if (!items.empty()) {
-            auto search = std::lower_bound(items.begin(), items.end(), morton_compare2);
-            if (search->pos == position) {
-                return {search->id};
+    std::optional<your_id> find_item(Position position) const {
+        key k = curve::encode(position);
+        item_id i = lower_bound(k);
+        if (i < keys.size() && keys[i] == k) {
+            return {items[i].id};
+        }
+        std::optional<your_id> found;
+        for_each_run([&](const run& r) {
+            auto search = std::lower_bound(r.keys.begin(), r.keys.end(), k);
+            if (!found && search != r.keys.end() && *search == k) {
+                found = r.items[search - r.keys.begin()].id;
+            }
+        });
+        return found;
+    }
+
+    const item& get_item(item_id id) const {
+        if (id < items.size()) {
+            return items[id];
+        }
+        id -= items.size();
+        for (const run& r: runs) {
+            if (id < r.items.size()) {
+                return r.items[id];
+            }
+            id -= r.items.size();
+        }
+        return buffer.items[id];
+    }
+
+private:
+    template<typename F>
+    static void scan_area(const std::vector<item>& is, const std::vector<key>& ks, item_id first, item_id base, const area& a, Position lo, Position hi, const key& last, F&& f) {
+        item_id i = first;
+        while (i < ks.size() && !(last < ks[i])) {
+            if (a.contains(is[i].pos)) {
+                f(base + i);
+                i++;
+                continue;
+            }
+            auto next = curve::bigmin(is[i].pos, lo, hi);
+            if (!next) {
+                return;
             }
+            i = lower_bound_from(ks, i, curve::encode(*next));
         }
-        return std::nullopt;
+    }
+public:
+    //calls f(item_id) for every item inside a
+    //walks the key range between the corners of a, and on reaching an item
+    //outside a jumps straight to the next key inside it (BIGMIN)
+    //the main array, each run and the buffer are walked in turn
+    template<typename F>
+    void for_each_item_within_area(const area& a, F&& f) const {
+        Position lo = a.min;
+        Position hi;
+        for (size_t d = 0; d < Dimension; d++) {
+            if (a.max[d] <= a.min[d]) {
+                return;
+            }
+            hi[d] = a.max[d] - 1;
+        }
+        key first = curve::encode(lo);
+        key last = curve::encode(hi);
+        scan_area(items, keys, lower_bound(first), 0, a, lo, hi, last, f);
+        item_id base = items.size();
+        for_each_run([&](const run& r) {
+            item_id start = std::lower_bound(r.keys.begin(), r.keys.end(), first) - r.keys.begin();
+            scan_area(r.items, r.keys, start, base, a, lo, hi, last, f);
+            base += r.items.size();
+        });
+    }
+    template<typename OutputIt>
+    OutputIt get_items_within_area(const area& a, OutputIt out) const {
+        for_each_item_within_area(a, [&](item_id i) {
+            *out++ = i;
+        });
+        return out;
+    }
+    std::vector<item_id> get_items_within_area(const area& a) const {
+        std::vector<item_id> out;
+        get_items_within_area(a, std::back_inserter(out));
+        return out;
     }
 
     void post_insert_check() {
+        auto check_run = [](const std::vector<item>& is, const std::vector<key>& ks) {
+            assert(ks.size() == is.size());
+            for (size_t i = 0; i < is.size(); i++) {
+                assert(ks[i] == curve::encode(is[i].pos));
+                assert(i == 0 || !(ks[i] < ks[i - 1]));
+            }
+        };
+        check_run(items, keys);
+        for (const run& r: runs) {
+            check_run(r.items, r.keys);
+        }
+        check_run(buffer.items, buffer.keys);
+        //with unique ids the index must point at every item
+        if (index.size() == size()) {
+            for (item_id i = 0; i < size(); i++) {
+                assert(*index.find(get_item(i).id) == i);
+            }
+        }
     }
 };
 
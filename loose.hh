@@ -0,0 +1,235 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <optional>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#include <cstdint>
+#include <cassert>
+
+#include "tree.hh"
+#include "flat_map.hh"
+
+namespace tree {
+
+//a loose octree for items with extents, boxes [min, max)
+//an item of largest side s belongs to level L, the smallest with 2^L >= s,
+//and is placed by its centre in a point tree holding only that level's
+//items, which makes its cell's bounds grown by half a cell on every side
+//(looseness 2) hold all of the item
+//a query grows its box by half a cell per level, so small items are never
+//over-queried by the size of the largest one, and keeps the candidates
+//whose own box overlaps it
+template<size_t Dimension, typename Coord, typename ID, size_t max_items_per_node = 64, storage leaf_storage = storage::pool>
+struct loose {
+    using item_id = uint32_t;
+    using your_id = ID;
+    using level_tree = tree<Dimension, Coord, item_id, max_items_per_node, leaf_storage>;
+    using Position = std::array<Coord, Dimension>;
+    using area = typename level_tree::area;
+    //the root level of every level tree
+    constexpr const static size_t root_level = std::numeric_limits<Coord>::digits - 1;
+    constexpr const static size_t num_levels = root_level + 1;
+
+    struct item {
+        area bounds;
+        your_id id;
+    };
+
+    static size_t level_of(const area& bounds) {
+        Coord side = 0;
+        for (size_t i = 0; i < Dimension; i++) {
+            side = std::max<Coord>(side, bounds.max[i] - bounds.min[i]);
+        }
+        size_t level = 0;
+        while (level < root_level && (Coord{1} << level) < side) {
+            level++;
+        }
+        return level;
+    }
+    static Position centre(const area& bounds) {
+        Position c;
+        for (size_t i = 0; i < Dimension; i++) {
+            c[i] = bounds.min[i] + (bounds.max[i] - bounds.min[i]) / 2;
+        }
+        return c;
+    }
+
+    void insert_items(const std::vector<item>& is) {
+        std::array<std::vector<typename level_tree::item>, num_levels> by_level;
+        for (const item& i: is) {
+            item_id id = allocate(i);
+            by_level[entries[id].level].push_back({centre(i.bounds), id, 0});
+        }
+        for (size_t l = 0; l < num_levels; l++) {
+            if (!by_level[l].empty()) {
+                level(l).insert_items(by_level[l]);
+            }
+        }
+    }
+    item_id insert_item(your_id data, const area& bounds) {
+        item_id id = allocate({bounds, data});
+        level(entries[id].level).insert_item(id, centre(bounds));
+        return id;
+    }
+    //an item that stays in its level moves inside that level's tree in one
+    //batch, one that changes level is taken out and put back in the other
+    void update_bounds(const std::vector<std::pair<your_id, area>>& moves) {
+        std::array<std::vector<std::pair<item_id, Position>>, num_levels> by_level;
+        for (auto& [data, bounds]: moves) {
+            const item_id* search = index.find(data);
+            if (search == nullptr) {
+                continue;
+            }
+            item_id id = *search;
+            entry& e = entries[id];
+            size_t l = level_of(bounds);
+            e.bounds = bounds;
+            if (l == e.level) {
+                by_level[l].push_back({id, centre(bounds)});
+            } else {
+                level_tree& from = level(e.level);
+                from.remove_item(*from.find_item(id));
+                e.level = l;
+                level(l).insert_item(id, centre(bounds));
+            }
+        }
+        for (size_t l = 0; l < num_levels; l++) {
+            if (!by_level[l].empty()) {
+                level(l).update_positions(by_level[l]);
+            }
+        }
+    }
+    void remove_item(item_id id) {
+        entry& e = entries[id];
+        assert(e.live);
+        level_tree& t = level(e.level);
+        t.remove_item(*t.find_item(id));
+        const item_id* search = index.find(e.id);
+        if (search != nullptr && *search == id) {
+            index.erase(e.id);
+        }
+        e.live = false;
+        free_items.push_back(id);
+    }
+    std::optional<item_id> find_item(your_id data) const {
+        const item_id* search = index.find(data);
+        if (search == nullptr) {
+            return std::nullopt;
+        }
+        return *search;
+    }
+    const area& bounds(item_id id) const {
+        return entries[id].bounds;
+    }
+    your_id id(item_id i) const {
+        return entries[i].id;
+    }
+
+    //calls f(item_id) for every item whose box overlaps a
+    template<typename F>
+    void for_each_item_overlapping(const area& a, F&& f) const {
+        for (size_t l = 0; l < num_levels; l++) {
+            if (!levels[l]) {
+                continue;
+            }
+            Coord half = (Coord{1} << l) / 2;
+            area grown;
+            for (size_t i = 0; i < Dimension; i++) {
+                grown.min[i] = a.min[i] > half ? a.min[i] - half : 0;
+                grown.max[i] = a.max[i] < limit - half ? a.max[i] + half : limit;
+            }
+            const level_tree& t = *levels[l];
+            t.for_each_item_within_area(grown, [&](typename level_tree::item_id i) {
+                item_id id = t.get_item(i).id;
+                if (entries[id].bounds.overlaps(a)) {
+                    f(id);
+                }
+            });
+        }
+    }
+    std::vector<item_id> get_items_overlapping(const area& a) const {
+        std::vector<item_id> out;
+        for_each_item_overlapping(a, [&](item_id i) {
+            out.push_back(i);
+        });
+        return out;
+    }
+    //calls f(item_id) for every item whose box holds p
+    template<typename F>
+    void for_each_item_containing(Position p, F&& f) const {
+        area cell;
+        for (size_t i = 0; i < Dimension; i++) {
+            cell.min[i] = p[i];
+            cell.max[i] = p[i] + 1;
+        }
+        for_each_item_overlapping(cell, f);
+    }
+    std::vector<item_id> get_items_containing(Position p) const {
+        std::vector<item_id> out;
+        for_each_item_containing(p, [&](item_id i) {
+            out.push_back(i);
+        });
+        return out;
+    }
+
+    void post_insert_check() const {
+        for (size_t l = 0; l < num_levels; l++) {
+            if (levels[l]) {
+                levels[l]->post_insert_check();
+            }
+        }
+        for (item_id id = 0; id < entries.size(); id++) {
+            const entry& e = entries[id];
+            if (e.live) {
+                assert(e.level == level_of(e.bounds));
+                auto i = level(e.level).find_item(id);
+                assert(i && level(e.level).get_item(*i).pos == centre(e.bounds));
+            }
+        }
+    }
+
+private:
+    struct entry {
+        area bounds;
+        your_id id;
+        uint8_t level;
+        bool live;
+    };
+    constexpr const static Coord limit = Coord{1} << root_level;
+
+    item_id allocate(const item& i) {
+        entry e {i.bounds, i.id, static_cast<uint8_t>(level_of(i.bounds)), true};
+        item_id id;
+        if (!free_items.empty()) {
+            id = free_items.back();
+            free_items.pop_back();
+            entries[id] = e;
+        } else {
+            id = entries.size();
+            entries.push_back(e);
+        }
+        index[i.id] = id;
+        return id;
+    }
+    level_tree& level(size_t l) {
+        if (!levels[l]) {
+            levels[l] = std::make_unique<level_tree>();
+        }
+        return *levels[l];
+    }
+    const level_tree& level(size_t l) const {
+        return *levels[l];
+    }
+
+    //one point tree per level that has held an item
+    std::array<std::unique_ptr<level_tree>, num_levels> levels;
+    std::vector<entry> entries;
+    std::vector<item_id> free_items;
+    flat::map<your_id, item_id> index;
+};
+
+}
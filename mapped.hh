@@ -0,0 +1,483 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <tuple>
+#include <optional>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "tree.hh"
+
+namespace tree {
+
+//a copy_on_write tree kept in a file laid out so that loading it is mapping
+//it: every chunk of the nodes, items, leaf blocks and id index is stored as
+//it sits in memory, and the loaded tree's chunks point straight into the
+//read only mapping, only the free lists are copied out
+//nodes, items and blocks already refer to each other by index, and the
+//file refers to its own parts by offset, so nothing needs fixing up
+//
+//the file starts with two superblocks, the current one is the one with a
+//good checksum and the higher sequence; it holds the shape of the tree,
+//which must match the one loading it, and where the table of chunk offsets
+//is
+//save appends only the chunks that are not already in the file since the
+//last save or load through this mapped_file, then the free lists and the
+//table, syncs, writes the other superblock and syncs again, so a crash
+//leaves the previous image current and readers that mapped an earlier
+//image never see its bytes change
+//once dead chunks outweigh live ones the file is written afresh to a
+//temporary file and renamed over the old one
+//one writer at a time; the checks on load catch a different tree or a
+//damaged file, they are no defence against a crafted one
+template<typename Tree>
+struct mapped_file {
+    static_assert(Tree::is_copy_on_write, "mapped_file needs a copy_on_write tree");
+    static_assert(std::is_trivially_copyable_v<typename Tree::node>, "mapped_file needs array or pool leaf storage");
+    static_assert(std::is_trivially_copyable_v<typename Tree::item>, "mapped_file needs a trivially copyable ID");
+
+    constexpr const static uint32_t format_version = 1;
+
+    explicit mapped_file(std::string path): path(std::move(path)) {}
+
+    //the last image saved, queryable straight away
+    std::shared_ptr<const Tree> open() {
+        return std::make_shared<const Tree>(load());
+    }
+    //the last image saved as a writable tree, each chunk is copied out of
+    //the mapping the first time it changes
+    Tree load() {
+        auto m = std::make_shared<const mapping>(path);
+        superblock sb = current(*m);
+        std::array<std::vector<uint64_t>, num_sections> offsets;
+        uint64_t entries = 0;
+        for (size_t s = 0; s < num_sections; s++) {
+            const section_info& info = sb.sections[s];
+            if (info.chunk_bytes != chunk_bytes()[s] || info.chunks != (info.count + per_chunk()[s] - 1) / per_chunk()[s]) {
+                malformed();
+            }
+            entries += info.chunks;
+        }
+        const char* table = m->at(sb.table_offset, entries * sizeof(uint64_t));
+        for (size_t s = 0, e = 0; s < num_sections; s++) {
+            for (uint64_t k = 0; k < sb.sections[s].chunks; k++, e++) {
+                uint64_t offset;
+                std::memcpy(&offset, table + e * sizeof(uint64_t), sizeof(offset));
+                if (offset % alignment != 0) {
+                    malformed();
+                }
+                m->at(offset, chunk_bytes()[s]);
+                offsets[s].push_back(offset);
+            }
+        }
+        if (sb.sections[next].count != sb.sections[blocks].count || sb.sections[control].count != sb.sections[slots].count || sb.sections[control].count % index_type::group_size != 0) {
+            malformed();
+        }
+
+        Tree t;
+        adopt(t.nodes, m, sb.sections[nodes].count, offsets[nodes]);
+        adopt(t.items, m, sb.sections[items].count, offsets[items]);
+        t.pool.chunks.clear();
+        for (uint64_t offset: offsets[blocks]) {
+            t.pool.chunks.emplace_back(m, const_cast<leaf_block*>(reinterpret_cast<const leaf_block*>(m->data + offset)));
+        }
+        adopt(t.pool.next, m, sb.sections[next].count, offsets[next]);
+        vector_type<int8_t> control_bytes;
+        vector_type<typename index_type::slot> slot_array;
+        adopt(control_bytes, m, sb.sections[control].count, offsets[control]);
+        adopt(slot_array, m, sb.sections[slots].count, offsets[slots]);
+        t.index = std::make_shared<index_type>(index_type::adopt(std::move(control_bytes), std::move(slot_array), sb.index_count, sb.index_tombstones));
+        read_list(*m, sb.lists[free_node_blocks], t.free_node_blocks);
+        read_list(*m, sb.lists[free_items], t.free_items);
+        read_list(*m, sb.lists[free_blocks], t.pool.free_blocks);
+        t.backing = m;
+
+        image = t.snapshot();
+        placed = std::move(offsets);
+        last = sb;
+        return t;
+    }
+    //makes t the current image
+    void save(const Tree& t) {
+        auto now = sections_of(t);
+        written w = image && last.file_bytes - last.live_bytes <= last.live_bytes ? append(t, now) : rewrite(t, now);
+        image = t.snapshot();
+        placed = std::move(w.offsets);
+        last = w.sb;
+    }
+
+private:
+    using pool_type = typename Tree::pool_type;
+    using leaf_block = typename Tree::leaf_block;
+    using index_type = typename Tree::index_type;
+    template<typename T>
+    using vector_type = typename Tree::template vector_type<T>;
+
+    enum section_id {
+        nodes,
+        items,
+        blocks,
+        next,
+        control,
+        slots,
+        num_sections,
+    };
+    enum list_id {
+        free_node_blocks,
+        free_items,
+        free_blocks,
+        num_lists,
+    };
+    struct section_info {
+        uint64_t count;
+        uint64_t chunk_bytes;
+        uint64_t chunks;
+    };
+    struct list_info {
+        uint64_t offset;
+        uint64_t count;
+    };
+    struct superblock {
+        std::array<char, 8> magic;
+        uint32_t format;
+        uint32_t byte_order;
+        uint64_t sequence;
+        //the shape of the tree that saved it
+        uint32_t dimension;
+        uint32_t coord_bytes;
+        uint32_t id_bytes;
+        uint32_t max_items_per_node;
+        uint32_t node_bytes;
+        uint32_t item_bytes;
+        //the table holds the offsets of every chunk of every section in turn
+        uint64_t table_offset;
+        std::array<section_info, num_sections> sections;
+        std::array<list_info, num_lists> lists;
+        uint64_t index_count;
+        uint64_t index_tombstones;
+        //the end of the file and how much of it this image uses
+        uint64_t file_bytes;
+        uint64_t live_bytes;
+        uint64_t checksum;
+    };
+    constexpr const static std::array<char, 8> magic = {'o', 'c', 't', 'r', 'e', 'e', '\0', '\0'};
+    constexpr const static uint32_t byte_order = 0x01020304;
+    constexpr const static uint64_t superblock_bytes = 4096;
+    static_assert(sizeof(superblock) <= superblock_bytes);
+    //chunks start on cache lines, and the mapping on a page
+    constexpr const static uint64_t alignment = 64;
+
+    using Position = typename Tree::Position;
+    using Coord = typename Position::value_type;
+
+    //a file mapped read only, the owner of every chunk that points into it
+    struct mapping {
+        const char* data = nullptr;
+        size_t size = 0;
+
+        explicit mapping(const std::string& path) {
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                fail("open", path);
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                int e = errno;
+                ::close(fd);
+                fail("stat", path, e);
+            }
+            size = st.st_size;
+            void* p = size == 0 ? nullptr : ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            int e = errno;
+            ::close(fd);
+            if (p == MAP_FAILED) {
+                fail("mmap", path, e);
+            }
+            data = static_cast<const char*>(p);
+        }
+        mapping(const mapping&) = delete;
+        mapping& operator=(const mapping&) = delete;
+        ~mapping() {
+            if (data != nullptr) {
+                ::munmap(const_cast<char*>(data), size);
+            }
+        }
+        //the bytes [offset, offset + n), which must lie inside the file
+        const char* at(uint64_t offset, uint64_t n) const {
+            if (offset > size || n > size - offset) {
+                malformed();
+            }
+            return data + offset;
+        }
+    };
+    //a file written through pwrite, closed when it goes
+    struct output {
+        int fd;
+
+        output(const std::string& path, int flags): fd(::open(path.c_str(), flags | O_WRONLY | O_CLOEXEC, 0644)), path(path) {
+            if (fd < 0) {
+                fail("open", path);
+            }
+        }
+        output(const output&) = delete;
+        output& operator=(const output&) = delete;
+        ~output() {
+            ::close(fd);
+        }
+        void write(uint64_t offset, const void* p, size_t n) {
+            const char* c = static_cast<const char*>(p);
+            while (n > 0) {
+                ssize_t w = ::pwrite(fd, c, n, offset);
+                if (w < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    fail("write", path);
+                }
+                c += w;
+                n -= w;
+                offset += w;
+            }
+        }
+        void sync() {
+            if (::fsync(fd) != 0) {
+                fail("sync", path);
+            }
+        }
+    private:
+        std::string path;
+    };
+    //the chunks of one section of a tree, in order
+    struct section {
+        std::vector<const void*> chunks;
+        uint64_t count;
+    };
+
+    std::string path;
+    //what the file held after the last save or load: a snapshot keeping its
+    //chunks alive, so a chunk still at the same address is still the same,
+    //and where each of them was put
+    std::shared_ptr<const Tree> image;
+    std::array<std::vector<uint64_t>, num_sections> placed;
+    superblock last {};
+
+    [[noreturn]] static void fail(const std::string& what, const std::string& path, int e = errno) {
+        throw std::system_error(e, std::generic_category(), what + " " + path);
+    }
+    [[noreturn]] static void malformed() {
+        throw std::runtime_error("mapped_file: malformed image");
+    }
+    static uint64_t align(uint64_t offset) {
+        return (offset + alignment - 1) & ~(alignment - 1);
+    }
+    //fnv-1a of everything before the checksum
+    static uint64_t checksum(const superblock& sb) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(&sb);
+        uint64_t h = 0xcbf29ce484222325;
+        for (size_t i = 0; i < offsetof(superblock, checksum); i++) {
+            h = (h ^ p[i]) * 0x100000001b3;
+        }
+        return h;
+    }
+
+    static constexpr std::array<uint64_t, num_sections> chunk_bytes() {
+        return {
+            sizeof(typename cow_vector<typename Tree::node>::chunk),
+            sizeof(typename cow_vector<typename Tree::item>::chunk),
+            pool_type::blocks_per_chunk * sizeof(leaf_block),
+            sizeof(typename cow_vector<typename pool_type::block_id>::chunk),
+            sizeof(typename cow_vector<int8_t>::chunk),
+            sizeof(typename cow_vector<typename index_type::slot>::chunk),
+        };
+    }
+    //elements per chunk
+    static constexpr std::array<uint64_t, num_sections> per_chunk() {
+        return {
+            cow_vector<typename Tree::node>::chunk_size,
+            cow_vector<typename Tree::item>::chunk_size,
+            pool_type::blocks_per_chunk,
+            cow_vector<typename pool_type::block_id>::chunk_size,
+            cow_vector<int8_t>::chunk_size,
+            cow_vector<typename index_type::slot>::chunk_size,
+        };
+    }
+    template<typename T>
+    static section section_of(const cow_vector<T>& v) {
+        section s {{}, v.size()};
+        for (auto& c: v.chunks) {
+            s.chunks.push_back(c.get());
+        }
+        return s;
+    }
+    static std::array<section, num_sections> sections_of(const Tree& t) {
+        section b {{}, t.pool.next.size()};
+        for (auto& c: t.pool.chunks) {
+            b.chunks.push_back(c.get());
+        }
+        return {
+            section_of(t.nodes),
+            section_of(t.items),
+            b,
+            section_of(t.pool.next),
+            section_of(t.index->control_bytes()),
+            section_of(t.index->slot_array()),
+        };
+    }
+    template<typename T>
+    static void adopt(cow_vector<T>& v, const std::shared_ptr<const mapping>& m, uint64_t count, const std::vector<uint64_t>& offsets) {
+        using chunk = typename cow_vector<T>::chunk;
+        v.chunks.clear();
+        for (uint64_t offset: offsets) {
+            v.chunks.emplace_back(m, const_cast<chunk*>(reinterpret_cast<const chunk*>(m->data + offset)));
+        }
+        v.count = count;
+    }
+    template<typename T>
+    static void read_list(const mapping& m, const list_info& l, std::vector<T>& out) {
+        if (l.count > m.size / sizeof(T)) {
+            malformed();
+        }
+        const char* p = m.at(l.offset, l.count * sizeof(T));
+        out.resize(l.count);
+        std::memcpy(out.data(), p, l.count * sizeof(T));
+    }
+
+    static superblock shape() {
+        superblock sb;
+        std::memset(&sb, 0, sizeof(sb));
+        sb.magic = magic;
+        sb.format = format_version;
+        sb.byte_order = byte_order;
+        sb.dimension = std::tuple_size_v<Position>;
+        sb.coord_bytes = sizeof(Coord);
+        sb.id_bytes = sizeof(typename Tree::your_id);
+        sb.max_items_per_node = std::tuple_size_v<decltype(leaf_block::ids)>;
+        sb.node_bytes = sizeof(typename Tree::node);
+        sb.item_bytes = sizeof(typename Tree::item);
+        return sb;
+    }
+    //the valid superblock with the higher sequence
+    superblock current(const mapping& m) const {
+        superblock expected = shape();
+        std::optional<superblock> best;
+        for (uint64_t slot = 0; slot < 2; slot++) {
+            if (m.size < (slot + 1) * superblock_bytes) {
+                break;
+            }
+            superblock sb;
+            std::memcpy(&sb, m.data + slot * superblock_bytes, sizeof(sb));
+            if (sb.magic != magic || sb.checksum != checksum(sb)) {
+                continue;
+            }
+            if (sb.format != format_version || sb.byte_order != byte_order) {
+                throw std::runtime_error("mapped_file: " + path + " is in another format");
+            }
+            if (std::memcmp(&sb.dimension, &expected.dimension, offsetof(superblock, table_offset) - offsetof(superblock, dimension)) != 0) {
+                throw std::runtime_error("mapped_file: " + path + " holds a different kind of tree");
+            }
+            if (!best || sb.sequence > best->sequence) {
+                best = sb;
+            }
+        }
+        if (!best) {
+            throw std::runtime_error("mapped_file: no image in " + path);
+        }
+        return *best;
+    }
+
+    struct written {
+        superblock sb;
+        std::array<std::vector<uint64_t>, num_sections> offsets;
+    };
+    //writes every chunk of now that is not already placed in the file, the
+    //free lists and the table from end on, then the superblock for it
+    //into slot sequence % 2
+    written write_image(output& f, uint64_t end, uint64_t sequence, const Tree& t, const std::array<section, num_sections>& now, const std::array<section, num_sections>* before) {
+        superblock sb = shape();
+        sb.sequence = sequence;
+        std::array<std::vector<uint64_t>, num_sections> offsets;
+        std::vector<uint64_t> table;
+        uint64_t live = 2 * superblock_bytes;
+        for (size_t s = 0; s < num_sections; s++) {
+            for (size_t k = 0; k < now[s].chunks.size(); k++) {
+                uint64_t offset;
+                if (before != nullptr && k < (*before)[s].chunks.size() && (*before)[s].chunks[k] == now[s].chunks[k]) {
+                    offset = placed[s][k];
+                } else {
+                    offset = end = align(end);
+                    f.write(offset, now[s].chunks[k], chunk_bytes()[s]);
+                    end += chunk_bytes()[s];
+                }
+                offsets[s].push_back(offset);
+                table.push_back(offset);
+                live += chunk_bytes()[s];
+            }
+            sb.sections[s] = {now[s].count, chunk_bytes()[s], now[s].chunks.size()};
+        }
+        auto write_list = [&](list_id l, const auto& v) {
+            end = align(end);
+            f.write(end, v.data(), v.size() * sizeof(v[0]));
+            sb.lists[l] = {end, v.size()};
+            end += v.size() * sizeof(v[0]);
+            live += v.size() * sizeof(v[0]);
+        };
+        write_list(free_node_blocks, t.free_node_blocks);
+        write_list(free_items, t.free_items);
+        write_list(free_blocks, t.pool.free_blocks);
+        end = align(end);
+        f.write(end, table.data(), table.size() * sizeof(uint64_t));
+        sb.table_offset = end;
+        end += table.size() * sizeof(uint64_t);
+        live += table.size() * sizeof(uint64_t);
+        sb.index_count = t.index->size();
+        sb.index_tombstones = t.index->tombstone_count();
+        sb.file_bytes = end;
+        sb.live_bytes = live;
+        sb.checksum = checksum(sb);
+        //the image must be on disk before the superblock that points at it
+        f.sync();
+        f.write((sequence % 2) * superblock_bytes, &sb, sizeof(sb));
+        f.sync();
+        return {sb, std::move(offsets)};
+    }
+    written append(const Tree& t, const std::array<section, num_sections>& now) {
+        auto before = sections_of(*image);
+        output f(path, 0);
+        return write_image(f, last.file_bytes, last.sequence + 1, t, now, &before);
+    }
+    written rewrite(const Tree& t, const std::array<section, num_sections>& now) {
+        std::string temporary = path + ".tmp";
+        written w;
+        {
+            output f(temporary, O_CREAT | O_TRUNC);
+            w = write_image(f, 2 * superblock_bytes, last.sequence + 1, t, now, nullptr);
+        }
+        if (::rename(temporary.c_str(), path.c_str()) != 0) {
+            fail("rename", temporary);
+        }
+        //and the rename itself durable
+        size_t slash = path.rfind('/');
+        std::string directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int fd = ::open(directory.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+        return w;
+    }
+};
+
+}
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <limits>
+#include <cstdint>
+#include <utility>
+#include <optional>
+#include <algorithm>
+
+#include "thread_pool.hh"
+
+#ifdef __BMI2__
+#include <immintrin.h>
+#endif
+
+namespace morton {
+
+//keys of a curve over Bits levels of Dimension coordinates: each level
+//contributes Dimension bits, the top level the most significant
+//keys wider than 64 bits are split into words of 64 / Dimension levels,
+//most significant word first, so they compare lexicographically
+//Curve supplies encode and index_order, everything here works on keys
+template<typename Curve, size_t Dimension, typename Coord, size_t Bits>
+struct keys {
+    using Position = std::array<Coord, Dimension>;
+    static constexpr size_t levels_per_word = 64 / Dimension;
+    static constexpr size_t num_words = (Bits + levels_per_word - 1) / levels_per_word;
+    static constexpr size_t bits_per_word = levels_per_word * Dimension;
+    static constexpr size_t num_children = size_t{1} << Dimension;
+    static_assert(Bits <= std::numeric_limits<Coord>::digits);
+    static_assert(std::numeric_limits<Coord>::digits <= 64);
+
+    struct key {
+        std::array<uint64_t, num_words> words;
+        bool operator<(const key& other) const {
+            return words < other.words;
+        }
+        bool operator==(const key& other) const {
+            return words == other.words;
+        }
+        bool operator!=(const key& other) const {
+            return words != other.words;
+        }
+    };
+
+    //key bits are numbered from the least significant end, bits_per_word
+    //to a word, so the unused top bits of each word are skipped
+    static size_t highest_bit_different(const key& a, const key& b) {
+        for (size_t w = 0; w < num_words; w++) {
+            uint64_t x = a.words[w] ^ b.words[w];
+            if (x != 0) {
+                return (num_words - 1 - w) * bits_per_word + 63 - __builtin_clzll(x);
+            }
+        }
+        return -1;
+    }
+    //count (at most 64) key bits starting at bit lo
+    static uint64_t extract(const key& k, size_t lo, size_t count) {
+        uint64_t out = 0;
+        for (size_t got = 0; got < count;) {
+            size_t w = (lo + got) / bits_per_word;
+            size_t j = (lo + got) % bits_per_word;
+            size_t n = std::min(count - got, bits_per_word - j);
+            uint64_t word = k.words[num_words - 1 - w] >> j;
+            out |= (n == 64 ? word : word & ((uint64_t{1} << n) - 1)) << got;
+            got += n;
+        }
+        return out;
+    }
+
+    //k with its key bits below bit n all cleared, or all set, the first
+    //and last keys of the cell at level n / Dimension that holds k
+    static key cell_first(key k, size_t n) {
+        return fill_below(k, n, false);
+    }
+    static key cell_last(key k, size_t n) {
+        return fill_below(k, n, true);
+    }
+    static key fill_below(key k, size_t n, bool ones) {
+        for (size_t w = 0; w < num_words && n != 0; w++) {
+            size_t m = std::min(n, bits_per_word);
+            uint64_t mask = m == 64 ? ~uint64_t{0} : (uint64_t{1} << m) - 1;
+            uint64_t& word = k.words[num_words - 1 - w];
+            word = ones ? word | mask : word & ~mask;
+            n -= m;
+        }
+        return k;
+    }
+    static Coord low_bits(size_t n) {
+        return n >= std::numeric_limits<Coord>::digits ? ~Coord{0} : (Coord{1} << n) - 1;
+    }
+    //the children of the cell at level holding p, in the order the curve
+    //visits them: child c holds the positions whose bit level - 1 of
+    //dimension i is bit i of c
+    static std::array<uint8_t, num_children> children_in_order(const Position& p, size_t level) {
+        std::array<uint8_t, num_children> order;
+        for (size_t c = 0; c < num_children; c++) {
+            order[c] = c;
+        }
+        if constexpr (!Curve::index_order) {
+            for (size_t c = 0; c < num_children; c++) {
+                Position q;
+                for (size_t i = 0; i < Dimension; i++) {
+                    q[i] = (p[i] & ~low_bits(level)) | (Coord((c >> i) & 1) << (level - 1));
+                }
+                order[extract(Curve::encode(q), (level - 1) * Dimension, Dimension)] = c;
+            }
+        }
+        return order;
+    }
+
+    struct entry {
+        key k;
+        size_t index;
+    };
+    static size_t key_byte(const key& k, size_t byte) {
+        return (k.words[num_words - 1 - byte / 8] >> (8 * (byte % 8))) & 0xff;
+    }
+    //stable lsd radix sort, one pass per key byte
+    //bytes that are the same in every key are skipped
+    static void radix_sort(std::vector<entry>& v) {
+        constexpr size_t num_bytes = num_words * 8;
+        if (v.size() < 2) {
+            return;
+        }
+        std::vector<std::array<size_t, 256>> counts(num_bytes);
+        for (const entry& e: v) {
+            for (size_t b = 0; b < num_bytes; b++) {
+                counts[b][key_byte(e.k, b)]++;
+            }
+        }
+        std::vector<entry> tmp(v.size());
+        for (size_t b = 0; b < num_bytes; b++) {
+            auto& count = counts[b];
+            if (count[key_byte(v[0].k, b)] == v.size()) {
+                continue;
+            }
+            size_t offset = 0;
+            for (size_t& c: count) {
+                size_t n = c;
+                c = offset;
+                offset += n;
+            }
+            for (const entry& e: v) {
+                tmp[count[key_byte(e.k, b)]++] = e;
+            }
+            v.swap(tmp);
+        }
+    }
+
+    //sorts v by the key of position_of(element), computing each key once
+    //returns the sorted keys
+    template<typename T, typename PositionOf>
+    static std::vector<key> sort(std::vector<T>& v, PositionOf position_of) {
+        std::vector<entry> entries(v.size());
+        for (size_t i = 0; i < v.size(); i++) {
+            entries[i] = {Curve::encode(position_of(v[i])), i};
+        }
+        radix_sort(entries);
+        std::vector<T> sorted;
+        sorted.reserve(v.size());
+        std::vector<key> keys;
+        keys.reserve(v.size());
+        for (const entry& e: entries) {
+            sorted.push_back(std::move(v[e.index]));
+            keys.push_back(e.k);
+        }
+        v.swap(sorted);
+        return keys;
+    }
+
+    //the same radix sort with each pass split into contiguous chunks
+    //each chunk counts its own bytes and then scatters to offsets that put
+    //it after the earlier chunks in every bucket, so the sort stays stable
+    static void radix_sort(std::vector<entry>& v, parallel::thread_pool& pool) {
+        constexpr size_t num_bytes = num_words * 8;
+        if (v.size() < 2) {
+            return;
+        }
+        size_t num_chunks = std::max<size_t>(1, std::min(v.size(), pool.size() * 4));
+        auto chunk_begin = [&](size_t c) { return v.size() * c / num_chunks; };
+        std::vector<std::array<std::array<size_t, 256>, num_bytes>> chunk_counts(num_chunks);
+        pool.parallel_for(num_chunks, [&](size_t c) {
+            auto& counts = chunk_counts[c];
+            for (auto& count: counts) {
+                count.fill(0);
+            }
+            for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                for (size_t b = 0; b < num_bytes; b++) {
+                    counts[b][key_byte(v[i].k, b)]++;
+                }
+            }
+        });
+        std::vector<entry> tmp(v.size());
+        std::vector<std::array<size_t, 256>> offsets(num_chunks);
+        for (size_t b = 0; b < num_bytes; b++) {
+            size_t first = key_byte(v[0].k, b);
+            size_t same = 0;
+            for (size_t c = 0; c < num_chunks; c++) {
+                same += chunk_counts[c][b][first];
+            }
+            if (same == v.size()) {
+                continue;
+            }
+            pool.parallel_for(num_chunks, [&](size_t c) {
+                offsets[c].fill(0);
+                for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                    offsets[c][key_byte(v[i].k, b)]++;
+                }
+            });
+            size_t offset = 0;
+            for (size_t bucket = 0; bucket < 256; bucket++) {
+                for (size_t c = 0; c < num_chunks; c++) {
+                    size_t n = offsets[c][bucket];
+                    offsets[c][bucket] = offset;
+                    offset += n;
+                }
+            }
+            pool.parallel_for(num_chunks, [&](size_t c) {
+                for (size_t i = chunk_begin(c); i < chunk_begin(c + 1); i++) {
+                    tmp[offsets[c][key_byte(v[i].k, b)]++] = v[i];
+                }
+            });
+            v.swap(tmp);
+        }
+    }
+
+    //sort with the key computation, radix passes and final permutation
+    //spread over pool
+    template<typename T, typename PositionOf>
+    static std::vector<key> sort(std::vector<T>& v, PositionOf position_of, parallel::thread_pool& pool) {
+        std::vector<entry> entries(v.size());
+        pool.parallel_chunks(v.size(), [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                entries[i] = {Curve::encode(position_of(v[i])), i};
+            }
+        });
+        radix_sort(entries, pool);
+        std::vector<T> sorted(v.size());
+        std::vector<key> keys(v.size());
+        pool.parallel_chunks(v.size(), [&](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                sorted[i] = std::move(v[entries[i].index]);
+                keys[i] = entries[i].k;
+            }
+        });
+        v.swap(sorted);
+        return keys;
+    }
+};
+
+//interleaves the low Bits bits of each coordinate into one integer key
+//dimension i is bit i of each interleaved group, the same order as the
+//child nodes of tree::tree
+template<size_t Dimension, typename Coord, size_t Bits = std::numeric_limits<Coord>::digits>
+struct curve: keys<curve<Dimension, Coord, Bits>, Dimension, Coord, Bits> {
+    using base = keys<curve, Dimension, Coord, Bits>;
+    using typename base::Position;
+    using typename base::key;
+    using base::levels_per_word;
+    using base::num_words;
+    using base::low_bits;
+    //children come in child index order at every level, which BIGMIN and
+    //the tree's partitions by child index rely on
+    static constexpr bool index_order = true;
+
+    static constexpr uint64_t spread_mask() {
+        uint64_t mask = 0;
+        for (size_t l = 0; l < levels_per_word; l++) {
+            mask |= uint64_t{1} << (l * Dimension);
+        }
+        return mask;
+    }
+    //moves bit l of x to bit l * Dimension
+    static uint64_t spread(uint64_t x) {
+#ifdef __BMI2__
+        return _pdep_u64(x, spread_mask());
+#else
+        if constexpr (Dimension == 1) {
+            return x;
+        } else if constexpr (Dimension == 2) {
+            x &= 0x00000000ffffffff;
+            x = (x | x << 16) & 0x0000ffff0000ffff;
+            x = (x | x << 8) & 0x00ff00ff00ff00ff;
+            x = (x | x << 4) & 0x0f0f0f0f0f0f0f0f;
+            x = (x | x << 2) & 0x3333333333333333;
+            x = (x | x << 1) & 0x5555555555555555;
+            return x;
+        } else if constexpr (Dimension == 3) {
+            x &= 0x00000000001fffff;
+            x = (x | x << 32) & 0x001f00000000ffff;
+            x = (x | x << 16) & 0x001f0000ff0000ff;
+            x = (x | x << 8) & 0x100f00f00f00f00f;
+            x = (x | x << 4) & 0x10c30c30c30c30c3;
+            x = (x | x << 2) & 0x1249249249249249;
+            return x;
+        } else {
+            uint64_t out = 0;
+            for (size_t l = 0; l < levels_per_word; l++) {
+                out |= ((x >> l) & 1) << (l * Dimension);
+            }
+            return out;
+        }
+#endif
+    }
+
+    static key encode(const Position& p) {
+        key k {};
+        for (size_t w = 0; w < num_words; w++) {
+            size_t shift = w * levels_per_word;
+            size_t levels = std::min(levels_per_word, Bits - shift);
+            uint64_t level_mask = levels == 64 ? ~uint64_t{0} : (uint64_t{1} << levels) - 1;
+            uint64_t word = 0;
+            for (size_t i = 0; i < Dimension; i++) {
+                uint64_t chunk = static_cast<uint64_t>(p[i] >> shift) & level_mask;
+                word |= spread(chunk) << i;
+            }
+            k.words[num_words - 1 - w] = word;
+        }
+        return k;
+    }
+
+    //BIGMIN (Tropf and Herzog): the position with the smallest key greater
+    //than the key of p inside the box [lo, hi] (corners inclusive), where p
+    //is outside the box but its key lies between the keys of lo and hi
+    //works on the coordinates directly, one key bit at a time from the top
+    static std::optional<Position> bigmin(const Position& p, Position lo, Position hi) {
+        std::optional<Position> result;
+        for (size_t level = Bits; level-- > 0;) {
+            for (size_t i = Dimension; i-- > 0;) {
+                bool v = (p[i] >> level) & 1;
+                bool a = (lo[i] >> level) & 1;
+                bool b = (hi[i] >> level) & 1;
+                if (!v && !a && b) {
+                    result = lo;
+                    (*result)[i] = (lo[i] & ~low_bits(level + 1)) | (Coord{1} << level);
+                    hi[i] = (hi[i] & ~low_bits(level + 1)) | low_bits(level);
+                } else if (!v && a && b) {
+                    return lo;
+                } else if (v && !a && !b) {
+                    return result;
+                } else if (v && !a && b) {
+                    lo[i] = (lo[i] & ~low_bits(level + 1)) | (Coord{1} << level);
+                }
+            }
+        }
+        return result;
+    }
+
+    //same order as comparing encode(a) and encode(b), without building keys
+    static bool compare(const Position& a, const Position& b) {
+        uint64_t bits = 0;
+        for (size_t i = 0; i < Dimension; i++) {
+            bits |= static_cast<uint64_t>(a[i] ^ b[i]);
+        }
+        if constexpr (Bits < 64) {
+            bits &= (uint64_t{1} << Bits) - 1;
+        }
+        if (bits == 0) {
+            return false;
+        }
+        size_t bit = 63 - __builtin_clzll(bits);
+        for (size_t i = Dimension; i-- > 0;) {
+            if (((a[i] ^ b[i]) >> bit) & 1) {
+                return ((b[i] >> bit) & 1) != 0;
+            }
+        }
+        return false;
+    }
+
+};
+
+}
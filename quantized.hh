@@ -0,0 +1,201 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <optional>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+
+#include "tree.hh"
+
+namespace tree {
+
+//a tree over floating point positions: positions inside the world bounds
+//[world_min, world_max) are mapped onto a grid of 2^bits cells per dimension and the
+//grid positions go into an integer tree, positions outside are clamped
+//onto the edge cells
+//the original positions are kept by item, every query runs on the grid
+//with a box or radius grown to cover the rounding, then keeps only the
+//items that pass the same test on their original positions
+template<size_t Dimension, typename Real, typename ID, size_t bits = 31, size_t max_items_per_node = 64, storage leaf_storage = storage::pool>
+struct quantized {
+    static_assert(std::is_floating_point_v<Real>);
+    static_assert(bits >= 1 && bits <= 63, "the grid must fit below the root of a 64 bit tree");
+    using grid_coord = std::conditional_t<bits <= 31, uint32_t, uint64_t>;
+    using grid_type = tree<Dimension, grid_coord, ID, max_items_per_node, leaf_storage>;
+    using grid_position = std::array<grid_coord, Dimension>;
+    using Position = std::array<Real, Dimension>;
+    using item_id = typename grid_type::item_id;
+    using cursor = typename grid_type::cursor;
+    using your_id = ID;
+
+    struct area {
+        Position min; //inclusive
+        Position max; //exclusive
+        bool contains(const Position& p) const {
+            for (size_t i = 0; i < Dimension; i++)
+                if (p[i] < min[i] || p[i] >= max[i])
+                    return false;
+            return true;
+        }
+    };
+    struct item {
+        Position pos;
+        your_id id;
+    };
+
+    quantized(const Position& world_min, const Position& world_max): lo(world_min) {
+        for (size_t i = 0; i < Dimension; i++) {
+            scale[i] = std::ldexp(1.0, bits) / (static_cast<double>(world_max[i]) - static_cast<double>(world_min[i]));
+            max_scale = std::max(max_scale, scale[i]);
+        }
+    }
+
+    //monotonic in each coordinate, so boxes map onto covering grid boxes
+    grid_position quantize(const Position& p) const {
+        grid_position q;
+        for (size_t i = 0; i < Dimension; i++) {
+            double x = std::floor((static_cast<double>(p[i]) - static_cast<double>(lo[i])) * scale[i]);
+            q[i] = static_cast<grid_coord>(std::clamp(x, 0.0, max_cell));
+        }
+        return q;
+    }
+    static double distance2(const Position& a, const Position& b) {
+        double d2 = 0;
+        for (size_t i = 0; i < Dimension; i++) {
+            double d = static_cast<double>(a[i]) - static_cast<double>(b[i]);
+            d2 += d * d;
+        }
+        return d2;
+    }
+
+    void insert_items(const std::vector<item>& is) {
+        std::vector<typename grid_type::item> grid_items;
+        grid_items.reserve(is.size());
+        for (const item& i: is) {
+            grid_items.push_back({quantize(i.pos), i.id, 0});
+        }
+        grid.insert_items(grid_items);
+        for (const item& i: is) {
+            set_position(*grid.find_item(i.id), i.pos);
+        }
+    }
+    item_id insert_item(your_id data, const Position& position) {
+        item_id id = grid.insert_item(data, quantize(position));
+        set_position(id, position);
+        return id;
+    }
+    void update_positions(const std::vector<std::pair<your_id, Position>>& moves) {
+        std::vector<std::pair<your_id, grid_position>> grid_moves;
+        grid_moves.reserve(moves.size());
+        for (auto& [data, position]: moves) {
+            if (auto id = grid.find_item(data)) {
+                positions[*id] = position;
+                grid_moves.push_back({data, quantize(position)});
+            }
+        }
+        grid.update_positions(grid_moves);
+    }
+    void remove_item(item_id id) {
+        grid.remove_item(id);
+    }
+    std::optional<item_id> find_item(your_id id) const {
+        return grid.find_item(id);
+    }
+    const Position& position(item_id id) const {
+        return positions[id];
+    }
+    your_id id(item_id i) const {
+        return grid.get_item(i).id;
+    }
+    const grid_type& get_grid() const {
+        return grid;
+    }
+
+    //calls f(item_id) for every item inside a
+    template<typename F>
+    void for_each_item_within_area(const area& a, F&& f) const {
+        typename grid_type::area g {quantize(a.min), quantize(a.max)};
+        for (size_t i = 0; i < Dimension; i++) {
+            g.max[i]++;
+        }
+        grid.for_each_item_within_area(g, [&](item_id i) {
+            if (a.contains(positions[i])) {
+                f(i);
+            }
+        });
+    }
+    std::vector<item_id> get_items_within_area(const area& a) const {
+        std::vector<item_id> out;
+        for_each_item_within_area(a, [&](item_id i) {
+            out.push_back(i);
+        });
+        return out;
+    }
+    //calls f(item_id) for every item within distance r of position
+    template<typename F>
+    void for_each_item_within_radius(cursor& c, const Position& position, Real r, F&& f) const {
+        for_each_item_within_distance2(c, position, static_cast<double>(r) * static_cast<double>(r), f);
+    }
+    std::vector<item_id> within_radius(cursor& c, const Position& position, Real r) const {
+        std::vector<item_id> out;
+        for_each_item_within_radius(c, position, r, [&](item_id i) {
+            out.push_back(i);
+        });
+        return out;
+    }
+    //the k items closest to position, closest first
+    //the k closest on the grid bound the true k-th distance from above, a
+    //radius query at that bound then holds every true candidate
+    std::vector<item_id> nearest(cursor& c, const Position& position, size_t k) const {
+        std::vector<item_id> out;
+        if (k == 0) {
+            return out;
+        }
+        double bound2 = 0;
+        for (item_id i: grid.nearest(c, quantize(position), k)) {
+            bound2 = std::max(bound2, distance2(positions[i], position));
+        }
+        std::vector<std::pair<double, item_id>> candidates;
+        for_each_item_within_distance2(c, position, bound2, [&](item_id i) {
+            candidates.push_back({distance2(positions[i], position), i});
+        });
+        k = std::min(k, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end());
+        for (size_t j = 0; j < k; j++) {
+            out.push_back(candidates[j].second);
+        }
+        return out;
+    }
+
+private:
+    //a grid step is at most one cell per dimension longer than the scaled
+    //step, so the grid radius adds the diagonal of a cell
+    template<typename F>
+    void for_each_item_within_distance2(cursor& c, const Position& position, double r2, F&& f) const {
+        double grid_r = std::ceil(std::sqrt(r2) * max_scale + std::sqrt(static_cast<double>(Dimension))) + 1;
+        grid.for_each_item_within_radius(c, quantize(position), static_cast<grid_coord>(std::min(grid_r, max_cell)), [&](item_id i) {
+            if (distance2(positions[i], position) <= r2) {
+                f(i);
+            }
+        });
+    }
+    void set_position(item_id id, const Position& p) {
+        if (id >= positions.size()) {
+            positions.resize(id + 1);
+        }
+        positions[id] = p;
+    }
+
+    constexpr const static double max_cell = static_cast<double>((uint64_t{1} << bits) - 1);
+    Position lo;
+    std::array<double, Dimension> scale {};
+    double max_scale = 0;
+    grid_type grid;
+    std::vector<Position> positions;
+};
+
+}
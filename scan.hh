@@ -0,0 +1,216 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+namespace scan {
+
+//leaf positions are stored one column per dimension, stride slots apart
+//columns are padded to a multiple of pad slots so the kernels can load
+//whole vectors past the last position, the extra lanes are masked off
+constexpr size_t pad = 16;
+constexpr size_t padded(size_t n) {
+    return (n + pad - 1) / pad * pad;
+}
+
+//tests up to 64 positions at a time against a box or a sphere and returns
+//a mask with bit j set when position j matches
+//AVX-512 and AVX2 kernels cover 32 and 64 bit integer coordinates, anything
+//else takes the scalar loop
+template<size_t Dimension, typename Coord>
+struct kernels {
+    using Position = std::array<Coord, Dimension>;
+    static constexpr bool vectorized = std::is_integral_v<Coord> && (sizeof(Coord) == 4 || sizeof(Coord) == 8);
+
+    static uint64_t low_mask(size_t n) {
+        return n >= 64 ? ~uint64_t{0} : (uint64_t{1} << n) - 1;
+    }
+    static bool inside(const Coord* columns, size_t stride, size_t j, const Position& min, const Position& max) {
+        for (size_t d = 0; d < Dimension; d++) {
+            Coord x = columns[d * stride + j];
+            if (x < min[d] || x >= max[d]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    //the same arithmetic as tree::distance2, so both agree on the boundary
+    static double distance2(const Coord* columns, size_t stride, size_t j, const Position& center) {
+        double d2 = 0;
+        for (size_t d = 0; d < Dimension; d++) {
+            Coord x = columns[d * stride + j];
+            Coord diff = x > center[d] ? x - center[d] : center[d] - x;
+            d2 += static_cast<double>(diff) * static_cast<double>(diff);
+        }
+        return d2;
+    }
+
+    //positions [0, n) inside [min, max), n at most 64
+    static uint64_t box_mask(const Coord* columns, size_t stride, size_t n, const Position& min, const Position& max) {
+        uint64_t mask = 0;
+        if constexpr (vectorized) {
+#if defined(__AVX512F__)
+            mask = box_avx512(columns, stride, n, min, max);
+#elif defined(__AVX2__)
+            mask = box_avx2(columns, stride, n, min, max);
+#else
+            mask = box_scalar(columns, stride, n, min, max);
+#endif
+        } else {
+            mask = box_scalar(columns, stride, n, min, max);
+        }
+        return mask & low_mask(n);
+    }
+    //positions [0, n) within distance r of center, n at most 64
+    static uint64_t sphere_mask(const Coord* columns, size_t stride, size_t n, const Position& center, Coord r) {
+        double r2 = static_cast<double>(r) * static_cast<double>(r);
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+        if constexpr (vectorized && sizeof(Coord) == 8) {
+            return sphere_avx512(columns, stride, n, center, r2) & low_mask(n);
+        }
+#endif
+        //the bounding cube first, then the exact test on what is left
+        Position min;
+        Position max;
+        for (size_t d = 0; d < Dimension; d++) {
+            Coord lowest = std::numeric_limits<Coord>::lowest();
+            Coord highest = std::numeric_limits<Coord>::max();
+            min[d] = center[d] >= lowest + r ? center[d] - r : lowest;
+            max[d] = center[d] < highest - r ? center[d] + r + 1 : highest;
+        }
+        uint64_t candidates = box_mask(columns, stride, n, min, max);
+        uint64_t mask = 0;
+        for (; candidates != 0; candidates &= candidates - 1) {
+            size_t j = __builtin_ctzll(candidates);
+            if (distance2(columns, stride, j, center) <= r2) {
+                mask |= uint64_t{1} << j;
+            }
+        }
+        return mask;
+    }
+
+private:
+    static uint64_t box_scalar(const Coord* columns, size_t stride, size_t n, const Position& min, const Position& max) {
+        uint64_t mask = 0;
+        for (size_t j = 0; j < n; j++) {
+            mask |= uint64_t{inside(columns, stride, j, min, max)} << j;
+        }
+        return mask;
+    }
+#if defined(__AVX2__)
+    //AVX2 only compares signed integers, flipping the sign bit maps the
+    //unsigned order onto the signed one
+    static uint64_t box_avx2(const Coord* columns, size_t stride, size_t n, const Position& min, const Position& max) {
+        constexpr size_t lanes = 32 / sizeof(Coord);
+        constexpr bool is_signed = std::numeric_limits<Coord>::is_signed;
+        __m256i flip;
+        if constexpr (sizeof(Coord) == 8) {
+            flip = _mm256_set1_epi64x(is_signed ? 0 : std::numeric_limits<int64_t>::min());
+        } else {
+            flip = _mm256_set1_epi32(is_signed ? 0 : std::numeric_limits<int32_t>::min());
+        }
+        __m256i lo[Dimension];
+        __m256i hi[Dimension];
+        for (size_t d = 0; d < Dimension; d++) {
+            if constexpr (sizeof(Coord) == 8) {
+                lo[d] = _mm256_xor_si256(_mm256_set1_epi64x(min[d]), flip);
+                hi[d] = _mm256_xor_si256(_mm256_set1_epi64x(max[d]), flip);
+            } else {
+                lo[d] = _mm256_xor_si256(_mm256_set1_epi32(min[d]), flip);
+                hi[d] = _mm256_xor_si256(_mm256_set1_epi32(max[d]), flip);
+            }
+        }
+        uint64_t mask = 0;
+        for (size_t j = 0; j < n; j += lanes) {
+            __m256i in = _mm256_set1_epi32(-1);
+            for (size_t d = 0; d < Dimension; d++) {
+                __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(columns + d * stride + j));
+                x = _mm256_xor_si256(x, flip);
+                if constexpr (sizeof(Coord) == 8) {
+                    in = _mm256_and_si256(in, _mm256_andnot_si256(_mm256_cmpgt_epi64(lo[d], x), _mm256_cmpgt_epi64(hi[d], x)));
+                } else {
+                    in = _mm256_and_si256(in, _mm256_andnot_si256(_mm256_cmpgt_epi32(lo[d], x), _mm256_cmpgt_epi32(hi[d], x)));
+                }
+            }
+            if constexpr (sizeof(Coord) == 8) {
+                mask |= uint64_t(_mm256_movemask_pd(_mm256_castsi256_pd(in))) << j;
+            } else {
+                mask |= uint64_t(_mm256_movemask_ps(_mm256_castsi256_ps(in))) << j;
+            }
+        }
+        return mask;
+    }
+#endif
+#if defined(__AVX512F__)
+    static uint64_t box_avx512(const Coord* columns, size_t stride, size_t n, const Position& min, const Position& max) {
+        constexpr size_t lanes = 64 / sizeof(Coord);
+        constexpr bool is_signed = std::numeric_limits<Coord>::is_signed;
+        __m512i lo[Dimension];
+        __m512i hi[Dimension];
+        for (size_t d = 0; d < Dimension; d++) {
+            if constexpr (sizeof(Coord) == 8) {
+                lo[d] = _mm512_set1_epi64(min[d]);
+                hi[d] = _mm512_set1_epi64(max[d]);
+            } else {
+                lo[d] = _mm512_set1_epi32(min[d]);
+                hi[d] = _mm512_set1_epi32(max[d]);
+            }
+        }
+        uint64_t mask = 0;
+        for (size_t j = 0; j < n; j += lanes) {
+            uint64_t in = ~uint64_t{0};
+            for (size_t d = 0; d < Dimension; d++) {
+                __m512i x = _mm512_loadu_si512(columns + d * stride + j);
+                if constexpr (sizeof(Coord) == 8 && is_signed) {
+                    in &= _mm512_cmp_epi64_mask(x, lo[d], _MM_CMPINT_NLT) & _mm512_cmp_epi64_mask(x, hi[d], _MM_CMPINT_LT);
+                } else if constexpr (sizeof(Coord) == 8) {
+                    in &= _mm512_cmp_epu64_mask(x, lo[d], _MM_CMPINT_NLT) & _mm512_cmp_epu64_mask(x, hi[d], _MM_CMPINT_LT);
+                } else if constexpr (is_signed) {
+                    in &= _mm512_cmp_epi32_mask(x, lo[d], _MM_CMPINT_NLT) & _mm512_cmp_epi32_mask(x, hi[d], _MM_CMPINT_LT);
+                } else {
+                    in &= _mm512_cmp_epu32_mask(x, lo[d], _MM_CMPINT_NLT) & _mm512_cmp_epu32_mask(x, hi[d], _MM_CMPINT_LT);
+                }
+            }
+            mask |= (in & low_mask(lanes)) << j;
+        }
+        return mask;
+    }
+#endif
+#if defined(__AVX512F__) && defined(__AVX512DQ__)
+    //distances in doubles, converted and summed in the order distance2 uses
+    static uint64_t sphere_avx512(const Coord* columns, size_t stride, size_t n, const Position& center, double r2) {
+        constexpr bool is_signed = std::numeric_limits<Coord>::is_signed;
+        __m512i c[Dimension];
+        for (size_t d = 0; d < Dimension; d++) {
+            c[d] = _mm512_set1_epi64(center[d]);
+        }
+        __m512d bound = _mm512_set1_pd(r2);
+        uint64_t mask = 0;
+        for (size_t j = 0; j < n; j += 8) {
+            __m512d d2 = _mm512_setzero_pd();
+            for (size_t d = 0; d < Dimension; d++) {
+                __m512i x = _mm512_loadu_si512(columns + d * stride + j);
+                __m512i diff;
+                if constexpr (is_signed) {
+                    diff = _mm512_sub_epi64(_mm512_max_epi64(x, c[d]), _mm512_min_epi64(x, c[d]));
+                } else {
+                    diff = _mm512_sub_epi64(_mm512_max_epu64(x, c[d]), _mm512_min_epu64(x, c[d]));
+                }
+                __m512d f = _mm512_cvtepu64_pd(diff);
+                d2 = _mm512_add_pd(d2, _mm512_mul_pd(f, f));
+            }
+            mask |= uint64_t(_mm512_cmp_pd_mask(d2, bound, _CMP_LE_OQ)) << j;
+        }
+        return mask;
+    }
+#endif
+};
+
+}
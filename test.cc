@@ -2,11 +2,24 @@
 #include <iostream>
 #include <algorithm>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <fstream>
+#include <cstdio>
 
 #include <Eigen/Dense>
 
+#include "scan.hh"
+#include "flat_map.hh"
+#include "kdtree.hh"
+#include "graph.hh"
+
 #if RUN == 0
 #include "tree.hh"
+#include "quantized.hh"
+#include "loose.hh"
+#include "mapped.hh"
 #elif RUN == 1
 #include "list.hh"
 #endif
@@ -14,11 +27,543 @@
 int main() {
     using coord = uint64_t;
 #if RUN == 0
-    tree::tree<2, coord, uint32_t> s{};
+#ifndef STORAGE
+#define STORAGE pool
+#endif
+    tree::tree<2, coord, uint32_t, 64, tree::storage::STORAGE> s{};
 #elif RUN == 1
     list::list<2, coord, uint32_t> s{};
 #endif
 
+    {
+        //morton keys order the same way as the pairwise comparison,
+        //including keys wider than 64 bits
+        using curve = morton::curve<3, uint64_t>;
+        std::mt19937_64 rng(0xfeed);
+        std::vector<curve::Position> ps;
+        for (size_t i = 0; i < 1000; i++) {
+            ps.push_back({rng() >> (i % 64), rng() >> (i % 7), rng()});
+        }
+        for (size_t i = 1; i < ps.size(); i++) {
+            auto& a = ps[i - 1];
+            auto& b = ps[i];
+            assert(curve::compare(a, b) == (curve::encode(a) < curve::encode(b)));
+            assert(curve::compare(b, a) == (curve::encode(b) < curve::encode(a)));
+        }
+        auto ps_parallel = ps;
+        curve::sort(ps, [](const curve::Position& p) { return p; });
+        assert(std::is_sorted(ps.begin(), ps.end(), curve::compare));
+        parallel::thread_pool threads(4);
+        curve::sort(ps_parallel, [](const curve::Position& p) { return p; }, threads);
+        assert(ps_parallel == ps);
+    }
+
+    {
+        //the leaf scan kernels agree with plain comparisons for every
+        //coordinate type they vectorize
+        auto check_kernels = [](auto zero) {
+            using c = decltype(zero);
+            using kernels = scan::kernels<3, c>;
+            constexpr size_t stride = scan::padded(64);
+            std::mt19937_64 rng(0xd00d);
+            std::uniform_int_distribution<int> dist(-100, 100);
+            c base = std::numeric_limits<c>::is_signed ? 0 : 1000;
+            std::array<c, 3 * stride> columns {};
+            for (auto& x: columns) {
+                x = base + dist(rng);
+            }
+            for (size_t q = 0; q < 200; q++) {
+                size_t n = 1 + q % 64;
+                std::array<c, 3> min;
+                std::array<c, 3> max;
+                std::array<c, 3> center;
+                for (size_t d = 0; d < 3; d++) {
+                    c x = base + dist(rng);
+                    c y = base + dist(rng);
+                    min[d] = std::min(x, y);
+                    max[d] = std::max(x, y);
+                    center[d] = base + dist(rng);
+                }
+                c r = q % 90;
+                uint64_t box = 0;
+                uint64_t sphere = 0;
+                for (size_t j = 0; j < n; j++) {
+                    double d2 = 0;
+                    bool inside = true;
+                    for (size_t d = 0; d < 3; d++) {
+                        c x = columns[d * stride + j];
+                        inside = inside && x >= min[d] && x < max[d];
+                        double diff = static_cast<double>(x) - static_cast<double>(center[d]);
+                        d2 += diff * diff;
+                    }
+                    box |= uint64_t{inside} << j;
+                    sphere |= uint64_t{d2 <= static_cast<double>(r) * r} << j;
+                }
+                assert(kernels::box_mask(columns.data(), stride, n, min, max) == box);
+                assert(kernels::sphere_mask(columns.data(), stride, n, center, r) == sphere);
+            }
+        };
+        check_kernels(int32_t{});
+        check_kernels(uint32_t{});
+        check_kernels(int64_t{});
+        check_kernels(uint64_t{});
+    }
+
+    {
+        //the flat index against std::unordered_map under insert/erase churn
+        flat::map<uint32_t, uint32_t> m;
+        std::unordered_map<uint32_t, uint32_t> expected;
+        std::mt19937_64 rng(0xf1a7);
+        for (uint32_t i = 0; i < 100000; i++) {
+            uint32_t k = rng() % 5000;
+            if (rng() % 3 == 0) {
+                assert(m.erase(k) == (expected.erase(k) == 1));
+            } else {
+                m[k] = i;
+                expected[k] = i;
+            }
+        }
+        assert(m.size() == expected.size());
+        for (auto& [k, v]: expected) {
+            assert(m.find(k) && *m.find(k) == v);
+        }
+        size_t visited = 0;
+        m.for_each([&](uint32_t k, uint32_t v) {
+            assert(expected.at(k) == v);
+            visited++;
+        });
+        assert(visited == expected.size());
+    }
+
+    {
+        //the benchmark's k-d tree baseline against a brute force scan
+        using kd = kdtree::kdtree<3, uint32_t, uint32_t>;
+        std::mt19937_64 rng(0xcd);
+        std::uniform_int_distribution<uint32_t> dist(0, 2000);
+        std::vector<kd::item> is;
+        for (uint32_t i = 0; i < 3000; i++) {
+            is.push_back({{dist(rng), dist(rng), dist(rng) / 8}, i});
+        }
+        kd k;
+        k.build(is);
+        for (size_t q = 0; q < 100; q++) {
+            kd::Position p = {dist(rng), dist(rng), dist(rng) / 8};
+            kd::area a {p, {p[0] + 300, p[1] + 200, p[2] + 40}};
+            uint32_t r = 150;
+            size_t in_box = 0;
+            size_t in_radius = 0;
+            std::vector<double> distances;
+            for (auto& it: is) {
+                in_box += a.contains(it.pos);
+                in_radius += kd::distance2(it.pos, p) <= double(r) * r;
+                distances.push_back(kd::distance2(it.pos, p));
+            }
+            std::sort(distances.begin(), distances.end());
+            size_t found = 0;
+            k.for_each_item_within_area(a, [&](size_t i) {
+                assert(a.contains(k.get_item(i).pos));
+                found++;
+            });
+            assert(found == in_box);
+            found = 0;
+            k.for_each_item_within_radius(p, r, [&](size_t) {
+                found++;
+            });
+            assert(found == in_radius);
+            auto near = k.nearest(p, 6);
+            assert(near.size() == 6);
+            for (size_t j = 0; j < 6; j++) {
+                assert(kd::distance2(k.get_item(near[j]).pos, p) == distances[j]);
+            }
+            assert(k.find_item(is[q].pos));
+        }
+    }
+    {
+        //neighbour graphs built serially and in parallel agree, and stay
+        //right as items move, come and go
+        using g2 = graph::graph<2, coord, uint32_t>;
+        std::mt19937_64 rng(0x96a);
+        std::uniform_int_distribution<coord> dist(0, 100000);
+        auto items = [&](size_t n) {
+            std::vector<g2::item> is;
+            for (uint32_t i = 0; i < n; i++) {
+                is.emplace_back(g2::Position {dist(rng), dist(rng)}, i);
+            }
+            return is;
+        };
+        auto is = items(3000);
+        std::vector<g2::item> copy;
+        for (auto& i: is) {
+            copy.emplace_back(i.pos, i.id);
+        }
+        g2 nearest(6);
+        nearest.insert_items(is);
+        nearest.post_insert_check();
+        parallel::thread_pool threads(3);
+        g2 built(6);
+        built.insert_items(copy, threads);
+        assert(built.num_edges() == 3000 * 6);
+        for (uint32_t i = 0; i < 3000; i++) {
+            std::vector<uint32_t> a;
+            std::vector<uint32_t> b;
+            nearest.for_each_neighbour(i, [&](const g2::item& n) { a.push_back(n.id); });
+            built.for_each_neighbour(i, [&](const g2::item& n) { b.push_back(n.id); });
+            assert(a == b && a.size() == 6);
+        }
+
+        //within a radius, where the edges are symmetric
+        g2 within(g2::unbounded, 3000);
+        auto ws = items(2000);
+        within.insert_items(ws, threads);
+        within.post_insert_check();
+
+        std::uniform_int_distribution<uint32_t> pick(0, 1999);
+        for (size_t frame = 0; frame < 10; frame++) {
+            std::vector<std::pair<uint32_t, g2::Position>> moves;
+            for (size_t j = 0; j < 40; j++) {
+                uint32_t i = pick(rng);
+                auto p = *nearest.find_item(i);
+                moves.push_back({i, {p[0] + dist(rng) % 2000, p[1] + dist(rng) % 2000}});
+            }
+            nearest.update_positions(moves);
+            within.update_positions(moves);
+            nearest.post_insert_check();
+            within.post_insert_check();
+        }
+        for (uint32_t i = 0; i < 2000; i += 50) {
+            nearest.remove_item(i);
+            within.remove_item(i);
+        }
+        nearest.post_insert_check();
+        within.post_insert_check();
+        for (uint32_t i = 5000; i < 5020; i++) {
+            g2::Position p {dist(rng), dist(rng)};
+            nearest.insert_item(i, p);
+            within.insert_item(i, p);
+        }
+        nearest.post_insert_check();
+        within.post_insert_check();
+        assert(nearest.size() == 3000 - 40 + 20);
+        for (uint32_t i = 0; i < within.size(); i++) {
+            for (uint32_t j: within.neighbours(i)) {
+                auto back = within.neighbours(j);
+                assert(std::find(back.begin(), back.end(), i) != back.end());
+            }
+        }
+    }
+
+#if RUN == 0
+    {
+        //more items on one position than fit in a leaf block
+        tree::tree<2, coord, uint32_t, 4> t{};
+        for (uint32_t i = 0; i < 19; i++) {
+            t.insert_item(i, {i == 0 ? 1u : 7u, 7});
+        }
+        t.post_insert_check();
+        for (uint32_t i = 1; i < 19; i += 3) {
+            t.remove_item(*t.find_item(i));
+        }
+        t.post_insert_check();
+        assert(t.get_items_within_area({{7, 7}, {8, 8}}).size() == 12);
+    }
+    {
+        //the parallel build lays out the same tree as the serial one
+        std::mt19937_64 rng(0xbeef);
+        std::normal_distribution<float> normal_dist(1000000, 4096);
+        std::vector<decltype(s)::item> is;
+        for (uint32_t i = 0; i < 20000; i++) {
+            is.push_back({{static_cast<coord>(normal_dist(rng)), static_cast<coord>(normal_dist(rng))}, i, 0});
+        }
+        auto is_parallel = is;
+        decltype(s) serial{};
+        serial.insert_items(is);
+        parallel::thread_pool threads(4);
+        decltype(s) built{};
+        built.insert_items(is_parallel, threads);
+        built.post_insert_check();
+        assert(built == serial);
+    }
+    {
+        //every pair within r exactly once, serial and split across threads
+        tree::tree<2, coord, uint32_t, 8, tree::storage::STORAGE> t{};
+        std::mt19937_64 rng(0x9a125);
+        std::normal_distribution<float> normal_dist(1000000, 1000);
+        std::vector<decltype(t)::item> is;
+        for (uint32_t i = 0; i < 4000; i++) {
+            is.push_back({{static_cast<coord>(normal_dist(rng)), static_cast<coord>(normal_dist(rng))}, i, 0});
+        }
+        t.insert_items(is);
+        coord r = 25;
+        std::vector<std::pair<uint32_t, uint32_t>> expected;
+        for (uint32_t i = 0; i < is.size(); i++) {
+            for (uint32_t j = i + 1; j < is.size(); j++) {
+                if (decltype(t)::distance2(t.get_item(i).pos, t.get_item(j).pos) <= double(r) * r) {
+                    expected.push_back({i, j});
+                }
+            }
+        }
+        auto normalized = [](std::vector<std::pair<uint32_t, uint32_t>> pairs) {
+            for (auto& [i, j]: pairs) {
+                if (j < i) {
+                    std::swap(i, j);
+                }
+            }
+            std::sort(pairs.begin(), pairs.end());
+            return pairs;
+        };
+        assert(!expected.empty());
+        assert(normalized(t.pairs_within(r)) == expected);
+        parallel::thread_pool threads(3);
+        assert(normalized(t.pairs_within(r, threads)) == expected);
+    }
+    {
+        //rays and view wedges against a brute force scan
+        using tree_t = tree::tree<2, coord, uint32_t, 8, tree::storage::STORAGE>;
+        tree_t t{};
+        std::mt19937_64 rng(0x4a7);
+        std::normal_distribution<double> normal_dist(1000000, 300);
+        std::vector<tree_t::item> is;
+        for (uint32_t i = 0; i < 3000; i++) {
+            is.push_back({{static_cast<coord>(normal_dist(rng)), static_cast<coord>(normal_dist(rng))}, i, 0});
+        }
+        t.insert_items(is);
+        std::vector<std::array<coord, 2>> positions(is.size());
+        for (uint32_t i = 0; i < is.size(); i++) {
+            positions[t.get_item(i).id] = t.get_item(i).pos;
+        }
+        for (size_t q = 0; q < 200; q++) {
+            //aimed at an item, sometimes along an axis, sometimes cut short
+            tree_t::ray r;
+            r.origin = {normal_dist(rng), normal_dist(rng)};
+            auto target = positions[rng() % positions.size()];
+            for (size_t i = 0; i < 2; i++) {
+                r.direction[i] = static_cast<double>(target[i]) + 0.5 - r.origin[i];
+            }
+            if (q % 10 == 0) {
+                r.direction[q % 20 == 0] = 0;
+            }
+            if (q % 3 == 0) {
+                r.length = 0.5;
+            }
+            std::vector<std::pair<uint32_t, double>> expected;
+            for (uint32_t i = 0; i < is.size(); i++) {
+                auto [t0, t1] = r.interval({t.get_item(i).pos, {t.get_item(i).pos[0] + 1, t.get_item(i).pos[1] + 1}});
+                if (t0 <= t1) {
+                    expected.push_back({i, t0});
+                }
+            }
+            std::sort(expected.begin(), expected.end(), [](auto& a, auto& b) {
+                return a.second < b.second || (a.second == b.second && a.first < b.first);
+            });
+            assert(t.all_hits(r) == expected);
+            auto first = t.first_hit(r);
+            assert(first ? !expected.empty() && *first == expected[0] : expected.empty());
+        }
+        for (size_t q = 0; q < 50; q++) {
+            //a wedge from an apex, cut off near and far
+            double x = normal_dist(rng);
+            double y = normal_dist(rng);
+            double angle = q * 0.7;
+            double spread = 0.2 + (q % 5) * 0.3;
+            auto side = [&](double a, double sign) {
+                return tree_t::plane {{-std::sin(a) * sign, std::cos(a) * sign}, (std::sin(a) * x - std::cos(a) * y) * sign};
+            };
+            std::array<double, 2> forward = {std::cos(angle), std::sin(angle)};
+            std::vector<tree_t::plane> planes = {
+                side(angle - spread, 1),
+                side(angle + spread, -1),
+                {forward, -(forward[0] * x + forward[1] * y) - 10},
+                {{-forward[0], -forward[1]}, forward[0] * x + forward[1] * y + 600},
+            };
+            std::vector<uint32_t> expected;
+            for (uint32_t i = 0; i < is.size(); i++) {
+                if (std::all_of(planes.begin(), planes.end(), [&](auto& p) { return p.distance(t.get_item(i).pos) >= 0; })) {
+                    expected.push_back(i);
+                }
+            }
+            auto got = t.get_items_in_frustum(planes);
+            std::sort(got.begin(), got.end());
+            assert(got == expected);
+            assert(q != 0 || !expected.empty());
+        }
+    }
+    {
+        //counters and shape from stats(), reset per interval
+        using tree_t = tree::tree<2, coord, uint32_t, 16, tree::storage::STORAGE, false, true>;
+        tree_t t{};
+        std::mt19937_64 rng(0x57a7);
+        std::uniform_int_distribution<coord> dist(0, 1 << 16);
+        for (uint32_t i = 0; i < 2000; i++) {
+            t.insert_item(i, {dist(rng), dist(rng)});
+        }
+        tree_t::cursor c;
+        for (size_t q = 0; q < 100; q++) {
+            t.nearest(c, {dist(rng), dist(rng)}, 4);
+        }
+        auto s = t.stats(c);
+        assert(s.splits > 0 && s.merges == 0);
+        assert(s.queries.descents == 100 && s.queries.finger_resets == 1);
+        assert(std::accumulate(s.queries.descents_by_depth.begin(), s.queries.descents_by_depth.end(), size_t{0}) == 100);
+        assert(s.queries.nodes_visited >= 100);
+        size_t items = 0;
+        for (size_t n = 0; n <= 16; n++) {
+            items += n * s.leaf_occupancy[n];
+        }
+        assert(items == 2000 && s.leaf_occupancy[17] == 0);
+        assert(std::accumulate(s.items_by_depth.begin(), s.items_by_depth.end(), size_t{0}) == 2000);
+        assert(s.node_bytes > 0 && s.item_bytes >= 2000 * sizeof(tree_t::item) && s.index_bytes > 0);
+        t.reset_stats();
+        for (uint32_t i = 0; i < 2000; i += 2) {
+            t.remove_item(*t.find_item(i));
+        }
+        s = t.stats();
+        assert(s.splits == 0 && s.merges > 0 && s.queries.descents == 0);
+        assert(std::accumulate(s.items_by_depth.begin(), s.items_by_depth.end(), size_t{0}) == 1000);
+    }
+    {
+        //readers query published snapshots while the writer moves, removes
+        //and inserts items
+        using tree_t = tree::tree<2, coord, uint32_t, 64, tree::storage::STORAGE, true>;
+        tree::snapshots<tree_t> published;
+        std::mt19937_64 rng(0xcafe);
+        std::uniform_int_distribution<coord> dist(1000000 - 20000, 1000000 + 20000);
+        std::vector<tree_t::item> is;
+        for (uint32_t i = 0; i < 5000; i++) {
+            is.push_back({{dist(rng), dist(rng)}, i, 0});
+        }
+        published.writer().insert_items(is);
+        published.publish();
+        tree_t::area everything {{0, 0}, {coord{1} << 62, coord{1} << 62}};
+        auto first = published.read();
+        auto first_items = first->get_items_within_area(everything);
+        std::atomic<bool> done {false};
+        std::vector<std::thread> readers;
+        for (size_t t = 0; t < 3; t++) {
+            readers.emplace_back([&]() {
+                tree_t::cursor c;
+                while (!done) {
+                    auto snapshot = published.read();
+                    snapshot->post_insert_check();
+                    //every version holds 5000 items
+                    assert(snapshot->get_items_within_area(everything).size() == 5000);
+                    assert(snapshot->nearest(c, {1000000, 1000000}, 4).size() == 4);
+                }
+            });
+        }
+        for (size_t frame = 0; frame < 20; frame++) {
+            tree_t& w = published.writer();
+            std::vector<std::pair<uint32_t, std::array<coord, 2>>> moves;
+            for (uint32_t i = 0; i < 5000; i += 7) {
+                moves.push_back({i, {dist(rng), dist(rng)}});
+            }
+            w.update_positions(moves);
+            uint32_t gone = frame * 100;
+            std::vector<tree_t::item> back;
+            for (uint32_t i = gone; i < gone + 100; i++) {
+                w.remove_item(*w.find_item(i));
+                back.push_back({{dist(rng), dist(rng)}, i, 0});
+            }
+            w.insert_items(back);
+            published.publish();
+        }
+        done = true;
+        for (auto& t: readers) {
+            t.join();
+        }
+        //the first snapshot never saw any of it
+        first->post_insert_check();
+        assert(first->get_items_within_area(everything) == first_items);
+        published.read()->post_insert_check();
+    }
+    {
+        //a saved tree maps back without copying its chunks, a loaded one
+        //copies them out of the mapping as they change, and later saves
+        //append what changed
+        using tree_t = tree::tree<2, coord, uint32_t, 64, tree::storage::pool, true>;
+        std::string path = "test-mapped.tree";
+        std::remove(path.c_str());
+        auto file_size = [&]() {
+            return static_cast<size_t>(std::ifstream(path, std::ios::binary | std::ios::ate).tellg());
+        };
+        std::mt19937_64 rng(0x3a9);
+        std::uniform_int_distribution<coord> dist(0, 1000000);
+        tree_t t;
+        std::vector<tree_t::item> is;
+        for (uint32_t i = 0; i < 20000; i++) {
+            is.push_back({{dist(rng), dist(rng)}, i, 0});
+        }
+        t.insert_items(is);
+        for (uint32_t i = 0; i < 20000; i += 3) {
+            t.remove_item(*t.find_item(i));
+        }
+        tree::mapped_file<tree_t> file(path);
+        file.save(t);
+        size_t full = file_size();
+        tree_t::area everything {{0, 0}, {coord{1} << 62, coord{1} << 62}};
+        auto expected = t.get_items_within_area(everything);
+        auto mapped = file.open();
+        mapped->post_insert_check();
+        assert(mapped->get_items_within_area(everything) == expected);
+        for (uint32_t i = 0; i < 20000; i++) {
+            auto found = mapped->find_item(i);
+            assert(found.has_value() == (i % 3 != 0));
+            if (found) {
+                assert(mapped->get_item(*found).pos == t.get_item(*t.find_item(i)).pos);
+            }
+        }
+
+        tree_t w = file.load();
+        std::vector<std::pair<uint32_t, std::array<coord, 2>>> moves;
+        for (uint32_t i = 1; i < 300; i += 3) {
+            moves.push_back({i, {dist(rng), dist(rng)}});
+        }
+        w.update_positions(moves);
+        for (uint32_t i = 0; i < 300; i += 3) {
+            w.insert_item(i, {dist(rng), dist(rng)});
+        }
+        w.post_insert_check();
+        file.save(w);
+        assert(file_size() < 2 * full);
+        auto reread = file.open();
+        reread->post_insert_check();
+        assert(reread->get_items_within_area(everything) == w.get_items_within_area(everything));
+        tree_t::cursor c;
+        assert(reread->nearest(c, {500000, 500000}, 8) == w.nearest({500000, 500000}, 8));
+        //the first mapping still reads the first image
+        assert(mapped->get_items_within_area(everything) == expected);
+
+        //a damaged superblock leaves the one before it current
+        {
+            std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+            f.seekp(64);
+            f.put('x');
+        }
+        assert(file.open()->get_items_within_area(everything) == expected);
+
+        //dead chunks are dropped once they outweigh the live ones
+        tree_t r = file.load();
+        for (size_t round = 0; round < 8; round++) {
+            moves.clear();
+            for (uint32_t i = 1; i < 20000; i += 3) {
+                moves.push_back({i, {dist(rng), dist(rng)}});
+            }
+            r.update_positions(moves);
+            file.save(r);
+            assert(file_size() < 3 * full);
+        }
+        assert(file.open()->get_items_within_area(everything) == r.get_items_within_area(everything));
+
+        bool refused = false;
+        try {
+            tree::mapped_file<tree::tree<3, coord, uint32_t, 64, tree::storage::pool, true>>(path).open();
+        } catch (const std::runtime_error&) {
+            refused = true;
+        }
+        assert(refused);
+        std::remove(path.c_str());
+    }
+#endif
+
     {
         std::mt19937_64 rng(0xfeed);
         std::normal_distribution<float> normal_dist(1000000, 1024);
@@ -32,19 +577,358 @@ int main() {
             };
             decltype(s)::item it{};
             it.pos = pos;
-            it.id = 0;
+            it.id = i;
             to_insert.push_back(std::move(it));
         }
         {
             using time_type = std::chrono::time_point<std::chrono::high_resolution_clock>;
             time_type start_time = std::chrono::high_resolution_clock::now();
+#if RUN == 0
+            //build from the first half, then merge the second half into it
+            std::vector<decltype(s)::item> second_half(to_insert.begin() + n / 2, to_insert.end());
+            to_insert.resize(n / 2);
+            s.insert_items(to_insert);
+            s.insert_items(second_half);
+            to_insert.insert(to_insert.end(), second_half.begin(), second_half.end());
+#else
             s.insert_items(to_insert);
+#endif
             time_type stop_time = std::chrono::high_resolution_clock::now();
             std::chrono::duration<double> diff = stop_time - start_time;
             std::cout << diff.count() << std::endl;
         }
         s.post_insert_check();
+
+        //box queries against a brute force scan
+        std::uniform_int_distribution<coord> box_dist(1000000 - 3000, 1000000 + 3000);
+        auto check_box_queries = [&]() {
+            for (size_t q = 0; q < 100; q++) {
+                decltype(s)::area a;
+                for (size_t d = 0; d < 2; d++) {
+                    coord x = box_dist(rng);
+                    coord y = box_dist(rng);
+                    a.min[d] = std::min(x, y);
+                    a.max[d] = std::max(x, y) + 1;
+                }
+                std::vector<uint32_t> expected;
+                for (auto& it: to_insert) {
+                    if (a.contains(it.pos)) {
+                        expected.push_back(it.id);
+                    }
+                }
+                std::vector<uint32_t> got;
+                s.for_each_item_within_area(a, [&](auto i) {
+                    got.push_back(s.get_item(i).id);
+                });
+                std::sort(expected.begin(), expected.end());
+                std::sort(got.begin(), got.end());
+                assert(got == expected);
+                assert(s.get_items_within_area(a).size() == expected.size());
+            }
+        };
+        check_box_queries();
+
+#if RUN == 1
+        //exact point lookups
+        for (auto& it: to_insert) {
+            auto found = s.find_item(it.pos);
+            assert(found && s.get_item(s.get_items_within_area({it.pos, {it.pos[0] + 1, it.pos[1] + 1}})[0]).pos == it.pos);
+        }
+        assert(!s.find_item({0, 0}));
+
+        //a trickle of single inserts between queries
+        for (size_t i = 0; i < 500; i++) {
+            std::array<coord, 2> pos = {box_dist(rng), box_dist(rng)};
+            uint32_t id = n + i;
+            s.insert_item(id, pos);
+            to_insert.push_back({pos, id});
+            assert(s.find_item(id) == pos);
+            assert(s.find_item(pos));
+            if (i % 100 == 0) {
+                s.post_insert_check();
+            }
+        }
+        s.post_insert_check();
+        check_box_queries();
+#endif
+
+#if RUN == 0
+        //nearest and radius queries against a brute force scan
+        auto distance2 = [](std::array<coord, 2> a, std::array<coord, 2> b) {
+            double d2 = 0;
+            for (size_t d = 0; d < 2; d++) {
+                double x = static_cast<double>(a[d]) - static_cast<double>(b[d]);
+                d2 += x * x;
+            }
+            return d2;
+        };
+        for (size_t q = 0; q < 100; q++) {
+            std::array<coord, 2> p = {box_dist(rng), box_dist(rng)};
+            std::vector<double> expected;
+            for (auto& it: to_insert) {
+                expected.push_back(distance2(it.pos, p));
+            }
+            std::sort(expected.begin(), expected.end());
+            size_t k = 1 + q % 20;
+            auto got = s.nearest(p, k);
+            assert(got.size() == k);
+            for (size_t j = 0; j < k; j++) {
+                assert(distance2(s.get_item(got[j]).pos, p) == expected[j]);
+            }
+            coord r = 50 + q * 5;
+            size_t expected_in_radius = std::count_if(expected.begin(), expected.end(), [&](double d2) {
+                return d2 <= static_cast<double>(r) * r;
+            });
+            assert(s.within_radius(p, r).size() == expected_in_radius);
+        }
+
+        //threads each with their own cursor query the same const tree
+        {
+            const auto& shared = s;
+            std::vector<std::array<coord, 2>> queries;
+            for (size_t q = 0; q < 200; q++) {
+                queries.push_back({box_dist(rng), box_dist(rng)});
+            }
+            std::vector<std::vector<uint32_t>> serial_results;
+            for (auto& p: queries) {
+                serial_results.push_back(s.nearest(p, 8));
+            }
+            std::vector<std::thread> threads;
+            for (size_t t = 0; t < 4; t++) {
+                threads.emplace_back([&, t]() {
+                    decltype(s)::cursor c;
+                    for (size_t q = t; q < queries.size(); q += 4) {
+                        assert(shared.nearest(c, queries[q], 8) == serial_results[q]);
+                    }
+                });
+            }
+            for (auto& t: threads) {
+                t.join();
+            }
+        }
+
+        //batched moves, mostly small steps with the odd long jump
+        std::uniform_int_distribution<int> step_dist(-300, 300);
+        for (size_t frame = 0; frame < 10; frame++) {
+            std::vector<std::pair<uint32_t, std::array<coord, 2>>> moves;
+            for (auto& it: to_insert) {
+                if (rng() % 50 == 0) {
+                    it.pos = {box_dist(rng), box_dist(rng)};
+                } else {
+                    it.pos[0] += step_dist(rng);
+                    it.pos[1] += step_dist(rng);
+                }
+                moves.push_back({it.id, it.pos});
+            }
+            s.update_positions(moves);
+            s.post_insert_check();
+        }
+        check_box_queries();
+
+        //entities found by id through their leaf, then what is near them
+        {
+            decltype(s)::cursor c;
+            for (auto& it: to_insert) {
+                auto found = s.find_node(c, it.id);
+                assert(found);
+                auto [leaf, leaf_area, level] = *found;
+                assert(leaf_area.contains(it.pos));
+                auto near = s.nearest(c, it.pos, 1);
+                assert(near.size() == 1 && s.get_item(near[0]).pos == it.pos);
+            }
+            assert(!s.find_node(c, n + 12345));
+        }
+
+        //batched queries give the answers of one call per query, in order
+        {
+            decltype(s)::cursor c;
+            decltype(s)::cursor single;
+            std::vector<std::array<coord, 2>> points;
+            std::vector<decltype(s)::area> boxes;
+            for (size_t q = 0; q < 300; q++) {
+                coord x = box_dist(rng);
+                coord y = box_dist(rng);
+                points.push_back({x, y});
+                boxes.push_back({{x, y}, {x + coord(rng() % 400), y + coord(rng() % 400)}});
+            }
+            auto nodes = s.batch_find_node(c, points);
+            auto in_boxes = s.batch_get_items_within_area(c, boxes);
+            auto in_radius = s.batch_within_radius(c, points, 150);
+            auto near = s.batch_nearest(c, points, 5);
+            assert(nodes.size() == points.size() && in_boxes.size() == points.size());
+            auto sorted = [](auto range) {
+                std::vector<uint32_t> v(range.begin(), range.end());
+                std::sort(v.begin(), v.end());
+                return v;
+            };
+            for (size_t q = 0; q < points.size(); q++) {
+                assert(std::get<0>(nodes[q]) == std::get<0>(s.find_node(single, points[q])));
+                std::vector<uint32_t> box_ids;
+                s.get_items_within_area(single, boxes[q], std::back_inserter(box_ids));
+                std::sort(box_ids.begin(), box_ids.end());
+                assert(sorted(in_boxes[q]) == box_ids);
+                assert(box_ids == sorted(s.get_items_within_area(boxes[q])));
+                auto radius_ids = s.within_radius(single, points[q], 150);
+                std::sort(radius_ids.begin(), radius_ids.end());
+                assert(sorted(in_radius[q]) == radius_ids);
+                auto near_ids = s.nearest(single, points[q], 5);
+                assert(std::vector<uint32_t>(near[q].begin(), near[q].end()) == near_ids);
+            }
+        }
+
+        //remove half the items, then refill the freed slots
+        size_t items_before = s.get_items_within_area({{0, 0}, {coord{1} << 62, coord{1} << 62}}).size();
+        std::vector<decltype(s)::item> removed;
+        for (size_t i = 0; i < to_insert.size(); i += 2) {
+            auto id = s.find_item(to_insert[i].id);
+            assert(id);
+            s.remove_item(*id);
+            assert(!s.find_item(to_insert[i].id));
+            removed.push_back(to_insert[i]);
+        }
+        s.post_insert_check();
+        assert(s.get_items_within_area({{0, 0}, {coord{1} << 62, coord{1} << 62}}).size() == items_before - removed.size());
+        s.insert_items(removed);
+        s.post_insert_check();
+        check_box_queries();
+#endif
+    }
+
+#if RUN == 0
+    {
+        //float entities in a quantized tree, queries refined against their
+        //float positions match a brute force scan
+        std::mt19937_64 rng(0xf10a7);
+        std::normal_distribution<float> normal_dist(0, 100);
+        using world = tree::quantized<2, float, uint32_t, 20, 64, tree::storage::STORAGE>;
+        world w({-500, -500}, {500, 500});
+        std::vector<Eigen::Vector2f> pos(3000);
+        std::vector<world::item> is;
+        for (uint32_t i = 0; i < pos.size(); i++) {
+            pos[i] = {normal_dist(rng), normal_dist(rng)};
+            is.push_back({{pos[i].x(), pos[i].y()}, i});
+        }
+        w.insert_items(is);
+        world::cursor c;
+        std::uniform_real_distribution<float> query_dist(-300, 300);
+        for (size_t frame = 0; frame < 5; frame++) {
+            std::vector<std::pair<uint32_t, world::Position>> moves;
+            for (uint32_t i = 0; i < pos.size(); i++) {
+                pos[i] += Eigen::Vector2f(normal_dist(rng), normal_dist(rng)) * 0.05f;
+                moves.push_back({i, {pos[i].x(), pos[i].y()}});
+            }
+            w.update_positions(moves);
+            w.get_grid().post_insert_check();
+            for (size_t q = 0; q < 50; q++) {
+                world::Position p = {query_dist(rng), query_dist(rng)};
+                float r = 1 + q;
+                world::area a {{p[0] - r, p[1] - r / 2}, {p[0] + r / 3, p[1] + r}};
+                std::vector<uint32_t> in_box;
+                std::vector<uint32_t> in_radius;
+                std::vector<double> distances;
+                for (uint32_t i = 0; i < pos.size(); i++) {
+                    world::Position x = {pos[i].x(), pos[i].y()};
+                    if (a.contains(x)) {
+                        in_box.push_back(i);
+                    }
+                    if (world::distance2(x, p) <= static_cast<double>(r) * r) {
+                        in_radius.push_back(i);
+                    }
+                    distances.push_back(world::distance2(x, p));
+                }
+                std::sort(distances.begin(), distances.end());
+                auto ids = [&](std::vector<world::item_id> got) {
+                    std::vector<uint32_t> out;
+                    for (auto i: got) {
+                        out.push_back(w.id(i));
+                    }
+                    std::sort(out.begin(), out.end());
+                    return out;
+                };
+                assert(ids(w.get_items_within_area(a)) == in_box);
+                assert(ids(w.within_radius(c, p, r)) == in_radius);
+                auto near = w.nearest(c, p, 5);
+                assert(near.size() == 5);
+                for (size_t j = 0; j < 5; j++) {
+                    assert(world::distance2(w.position(near[j]), p) == distances[j]);
+                }
+            }
+        }
     }
+    {
+        //colliders of very different sizes in a loose tree, overlap queries
+        //match a brute force scan through moves, resizes and removals
+        std::mt19937_64 rng(0x1005e);
+        using colliders = tree::loose<2, uint32_t, uint32_t, 16, tree::storage::STORAGE>;
+        using area = colliders::area;
+        std::uniform_int_distribution<uint32_t> pos_dist(10000, 20000);
+        auto random_box = [&]() {
+            uint32_t x = pos_dist(rng);
+            uint32_t y = pos_dist(rng);
+            uint32_t side = 1 + rng() % (uint32_t{1} << (rng() % 12));
+            return area {{x, y}, {x + side, y + 1 + uint32_t(rng() % side)}};
+        };
+        colliders l;
+        std::vector<area> boxes;
+        std::vector<colliders::item> is;
+        for (uint32_t i = 0; i < 2000; i++) {
+            boxes.push_back(random_box());
+            is.push_back({boxes.back(), i});
+        }
+        l.insert_items(is);
+        std::vector<bool> live(boxes.size(), true);
+        auto check_queries = [&]() {
+            l.post_insert_check();
+            for (size_t q = 0; q < 100; q++) {
+                area a = random_box();
+                std::vector<uint32_t> expected;
+                for (uint32_t i = 0; i < boxes.size(); i++) {
+                    if (live[i] && boxes[i].overlaps(a)) {
+                        expected.push_back(i);
+                    }
+                }
+                std::vector<uint32_t> got;
+                for (auto id: l.get_items_overlapping(a)) {
+                    got.push_back(l.id(id));
+                }
+                std::sort(got.begin(), got.end());
+                assert(got == expected);
+                std::vector<uint32_t> containing;
+                for (auto id: l.get_items_containing(a.min)) {
+                    assert(l.bounds(id).contains(a.min));
+                    containing.push_back(l.id(id));
+                }
+                for (uint32_t i = 0; i < boxes.size(); i++) {
+                    assert(!(live[i] && boxes[i].contains(a.min)) || std::count(containing.begin(), containing.end(), i) == 1);
+                }
+            }
+        };
+        check_queries();
+        std::vector<std::pair<uint32_t, area>> moves;
+        for (uint32_t i = 0; i < boxes.size(); i++) {
+            if (i % 3 == 0) {
+                boxes[i] = random_box();
+            } else {
+                uint32_t dx = rng() % 50;
+                for (auto* corner: {&boxes[i].min, &boxes[i].max}) {
+                    (*corner)[0] += dx;
+                }
+            }
+            moves.push_back({i, boxes[i]});
+        }
+        l.update_bounds(moves);
+        check_queries();
+        for (uint32_t i = 0; i < boxes.size(); i += 4) {
+            l.remove_item(*l.find_item(i));
+            live[i] = false;
+        }
+        assert(!l.find_item(0));
+        check_queries();
+        l.insert_item(0, boxes[0]);
+        live[0] = true;
+        check_queries();
+    }
+#endif
 
     {
         std::mt19937_64 rng(0xfeed);
@@ -87,5 +971,5 @@ int main() {
 
     }
 
-    return 1;
+    return 0;
 }
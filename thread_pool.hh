@@ -0,0 +1,112 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+
+namespace parallel {
+
+//a fixed set of worker threads that run parallel_for jobs together with
+//the calling thread
+//jobs must not start another parallel_for on the same pool
+struct thread_pool {
+    explicit thread_pool(size_t num_threads = std::thread::hardware_concurrency()) {
+        for (size_t i = 1; i < num_threads; i++) {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+    ~thread_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& w: workers) {
+            w.join();
+        }
+    }
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    //threads taking part in a job, the caller included
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    //calls f(i) for every i in [0, n) and returns once all calls are done
+    template<typename F>
+    void parallel_for(size_t n, F&& f) {
+        if (workers.empty() || n <= 1) {
+            for (size_t i = 0; i < n; i++) {
+                f(i);
+            }
+            return;
+        }
+        std::function<void(size_t)> fn = [&f](size_t i) { f(i); };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = &fn;
+            job_size = n;
+            next = 0;
+            active = workers.size();
+            generation++;
+        }
+        wake.notify_all();
+        run_job();
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [this]() { return active == 0; });
+        job = nullptr;
+    }
+
+    //splits [0, n) into about size() * 4 contiguous chunks and calls
+    //f(chunk, begin, end) for each, returns the number of chunks
+    template<typename F>
+    size_t parallel_chunks(size_t n, F&& f) {
+        size_t num_chunks = std::max<size_t>(1, std::min(n, size() * 4));
+        parallel_for(num_chunks, [&](size_t c) {
+            f(c, n * c / num_chunks, n * (c + 1) / num_chunks);
+        });
+        return num_chunks;
+    }
+
+private:
+    void run_job() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < job_size) {
+            (*job)(i);
+        }
+    }
+    void work() {
+        size_t seen = 0;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            lock.unlock();
+            run_job();
+            lock.lock();
+            if (--active == 0) {
+                idle.notify_all();
+            }
+        }
+    }
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool stopping = false;
+    size_t generation = 0;
+    size_t active = 0;
+    std::function<void(size_t)>* job = nullptr;
+    size_t job_size = 0;
+    std::atomic<size_t> next {0};
+};
+
+}
@@ -1,7 +1,8 @@
+#pragma once
+
 #include <vector>
 #include <array>
 #include <optional>
-#include <unordered_map>
 #include <cassert>
 #include <cstdint>
 #include <cstdbool>
@@ -9,13 +10,190 @@
 #include <ostream>
 #include <iostream>
 #include <algorithm>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <atomic>
+
+#include "morton.hh"
+#include "scan.hh"
+#include "flat_map.hh"
 
 namespace tree {
 
-template<size_t Dimension, typename Coord, typename ID, size_t max_items_per_node = 64, bool use_array = false>
+//where leaf nodes keep their item indices
+//vector: a std::vector per node
+//array: max_items_per_node slots inline in every node
+//pool: fixed size blocks shared out of a block_pool, internal nodes carry none
+enum class storage {
+    vector,
+    array,
+    pool,
+};
+
+//points p at a copy of what it holds unless nothing else shares it
+//use_count can only rise through the owner of p, so once it reads 1 it
+//stays 1, and the fence orders the last reader's accesses before ours
+template<typename P, typename Copy>
+void unshare(P& p, Copy copy) {
+    if (p.use_count() > 1) {
+        p = copy(p);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+}
+
+//a vector split into fixed size chunks held by shared_ptr
+//copies share every chunk and a chunk is copied the first time it is
+//written through a container that shares it, so copying the whole
+//container costs one pointer per chunk
+template<typename T>
+struct cow_vector {
+    constexpr const static size_t chunk_size = std::max<size_t>(1, (16 * 1024) / sizeof(T));
+    using chunk = std::array<T, chunk_size>;
+
+    std::vector<std::shared_ptr<chunk>> chunks;
+    size_t count = 0;
+
+    size_t size() const {
+        return count;
+    }
+    bool empty() const {
+        return count == 0;
+    }
+    void reserve(size_t) {
+    }
+    const T& operator[](size_t i) const {
+        return (*chunks[i / chunk_size])[i % chunk_size];
+    }
+    T& operator[](size_t i) {
+        auto& c = chunks[i / chunk_size];
+        unshare(c, [](const std::shared_ptr<chunk>& p) { return std::make_shared<chunk>(*p); });
+        return (*c)[i % chunk_size];
+    }
+    void resize(size_t n) {
+        for (size_t i = n; i < count; i++) {
+            (*this)[i] = T{};
+        }
+        chunks.resize((n + chunk_size - 1) / chunk_size);
+        for (auto& c: chunks) {
+            if (!c) {
+                c = std::make_shared<chunk>();
+            }
+        }
+        count = n;
+    }
+    void push_back(const T& t) {
+        resize(count + 1);
+        (*this)[count - 1] = t;
+    }
+    //copies every shared chunk now, so later writes from several threads
+    //never have to
+    void unshare_all() {
+        for (size_t i = 0; i < count; i += chunk_size) {
+            (*this)[i];
+        }
+    }
+};
+
+//fixed size blocks of T carved out of large chunks, so many small owners
+//share one allocation per chunk
+//blocks can be chained for owners that outgrow one block
+//with copy_on_write, copies of the pool share chunks as cow_vector does
+template<typename T, size_t block_size, bool copy_on_write = false>
+struct block_pool {
+    using block_id = uint32_t;
+    constexpr const static block_id INVALID_BLOCK_ID = std::numeric_limits<block_id>::max();
+    constexpr const static size_t blocks_per_chunk = std::max<size_t>(1, (64 * 1024) / (block_size * sizeof(T)));
+    using chunk_ptr = std::conditional_t<copy_on_write, std::shared_ptr<T[]>, std::unique_ptr<T[]>>;
+
+    std::vector<chunk_ptr> chunks;
+    std::conditional_t<copy_on_write, cow_vector<block_id>, std::vector<block_id>> next;
+    std::vector<block_id> free_blocks;
+
+    block_id allocate() {
+        block_id b;
+        if (!free_blocks.empty()) {
+            b = free_blocks.back();
+            free_blocks.pop_back();
+        } else {
+            b = next.size();
+            if (b % blocks_per_chunk == 0) {
+                chunks.emplace_back(new T[blocks_per_chunk * block_size]());
+            }
+            next.push_back(INVALID_BLOCK_ID);
+        }
+        next[b] = INVALID_BLOCK_ID;
+        return b;
+    }
+    void release(block_id b) {
+        free_blocks.push_back(b);
+    }
+    T* operator[](block_id b) {
+        auto& c = chunks[b / blocks_per_chunk];
+        if constexpr (copy_on_write) {
+            unshare(c, [](const chunk_ptr& p) {
+                chunk_ptr copy(new T[blocks_per_chunk * block_size]);
+                std::copy(p.get(), p.get() + blocks_per_chunk * block_size, copy.get());
+                return copy;
+            });
+        }
+        return c.get() + (b % blocks_per_chunk) * block_size;
+    }
+    const T* operator[](block_id b) const {
+        return chunks[b / blocks_per_chunk].get() + (b % blocks_per_chunk) * block_size;
+    }
+    //heap bytes held by the chunks, the chain links and the free list
+    size_t bytes() const {
+        return chunks.size() * blocks_per_chunk * block_size * sizeof(T) + next.size() * sizeof(block_id) + free_blocks.capacity() * sizeof(block_id);
+    }
+    void unshare_all() {
+        if constexpr (copy_on_write) {
+            for (size_t b = 0; b < next.size(); b += blocks_per_chunk) {
+                (*this)[b];
+            }
+            next.unshare_all();
+        }
+    }
+};
+
+template<typename Tree>
+struct mapped_file;
+
+//the answers to a batch of queries, in the order the queries were given,
+//stored flat: query q owns values[offsets[q]] up to values[offsets[q + 1]]
+template<typename T>
+struct batch_results {
+    struct range {
+        const T* first;
+        const T* last;
+        const T* begin() const {
+            return first;
+        }
+        const T* end() const {
+            return last;
+        }
+        size_t size() const {
+            return last - first;
+        }
+    };
+    std::vector<size_t> offsets {0};
+    std::vector<T> values;
+
+    size_t size() const {
+        return offsets.size() - 1;
+    }
+    range operator[](size_t q) const {
+        return {values.data() + offsets[q], values.data() + offsets[q + 1]};
+    }
+};
+
+//with copy_on_write the nodes, items and leaf blocks live in shared chunks,
+//so snapshot() is cheap and the tree can be published to readers while
+//it keeps changing, see snapshots below
+//with_stats counts what the tree and its cursors do, see stats()
+template<size_t Dimension, typename Coord, typename ID, size_t max_items_per_node = 64, storage leaf_storage = storage::pool, bool copy_on_write = false, bool with_stats = false>
 struct tree {
 private:
-    using item_id = uint32_t;
     using node_id = uint32_t;
     using your_id = ID;
     using Position = std::array<Coord, Dimension>;
@@ -35,6 +213,8 @@ private:
         }
     }
 
+public:
+    using item_id = uint32_t;
     struct area {
         Position min; //inclusive
         Position max; //exclusive
@@ -42,19 +222,53 @@ private:
             os << min << " " << max << std::endl;
             return os;
         }
-        bool contains(Position p) {
+        bool contains(Position p) const {
             for (size_t i = 0; i < Dimension; i++)
                 if (p[i] < min[i] || p[i] >= max[i])
                     return false;
             return true;
         }
-        bool overlaps(area a) {
+        bool contains(const area& a) const {
+            for (size_t i = 0; i < Dimension; i++)
+                if (a.min[i] < min[i] || a.max[i] > max[i])
+                    return false;
+            return true;
+        }
+        bool overlaps(const area& a) const {
             for (size_t i = 0; i < Dimension; i++)
-                if (a.max[i] < min[i] || a.min[i] > max[i])
+                if (a.max[i] <= min[i] || a.min[i] >= max[i])
                     return false;
             return true;
         }
-        area child(size_t child_index) {
+        //squared distance from p to the closest point inside the area
+        double distance2(Position p) const {
+            double d2 = 0;
+            for (size_t i = 0; i < Dimension; i++) {
+                Coord d = 0;
+                if (p[i] < min[i]) {
+                    d = min[i] - p[i];
+                } else if (p[i] >= max[i]) {
+                    d = p[i] - (max[i] - 1);
+                }
+                d2 += static_cast<double>(d) * static_cast<double>(d);
+            }
+            return d2;
+        }
+        //squared distance between the closest points of the two areas
+        double distance2(const area& a) const {
+            double d2 = 0;
+            for (size_t i = 0; i < Dimension; i++) {
+                Coord d = 0;
+                if (a.max[i] <= min[i]) {
+                    d = min[i] - (a.max[i] - 1);
+                } else if (a.min[i] >= max[i]) {
+                    d = a.min[i] - (max[i] - 1);
+                }
+                d2 += static_cast<double>(d) * static_cast<double>(d);
+            }
+            return d2;
+        }
+        area child(size_t child_index) const {
             area child = *this;
             Coord half_sidelength = (max[0] - min[0]) / 2;
             for (size_t i = 0; i < Dimension; i++) {
@@ -67,18 +281,7 @@ private:
             }
             return child;
         }
-        std::pair<area, node_id> child(Position position) {
-            for (size_t i = 0; i < num_child_nodes; i++) {
-                area child_node_area = child(i);
-                if (child_node_area.contains(position)) {
-                    return {child_node_area, i};
-                }
-            }
-            assert(false);
-        }
     };
-
-public:
     struct item {
         Position pos;
         your_id id;
@@ -87,79 +290,414 @@ public:
 private:
 
     constexpr const static node_id INVALID_NODE_ID = 0;
-    struct node {
+    using kernels = scan::kernels<Dimension, Coord>;
+    //the item ids of a leaf, or of one block of a chained pool leaf, with
+    //a copy of their positions alongside, one column per dimension, which
+    //is what the scan kernels read
+    struct leaf_block {
+        constexpr const static size_t stride = scan::padded(max_items_per_node);
+        std::array<item_id, max_items_per_node> ids;
+        std::array<Coord, Dimension * stride> columns;
+        void set(size_t j, item_id i, const Position& p) {
+            ids[j] = i;
+            for (size_t d = 0; d < Dimension; d++) {
+                columns[d * stride + j] = p[d];
+            }
+        }
+        Position position(size_t j) const {
+            Position p;
+            for (size_t d = 0; d < Dimension; d++) {
+                p[d] = columns[d * stride + j];
+            }
+            return p;
+        }
+    };
+    using pool_type = block_pool<leaf_block, 1, copy_on_write>;
+    template<typename T>
+    using vector_type = std::conditional_t<copy_on_write, cow_vector<T>, std::vector<T>>;
+    struct vector_node {
+        node_id parent_node_index = INVALID_NODE_ID;
+        node_id child_nodes_index = INVALID_NODE_ID;
+        uint8_t level = 0;
+        std::vector<item_id> items_indices {};
+    };
+    struct array_node {
         node_id parent_node_index = INVALID_NODE_ID;
         node_id child_nodes_index = INVALID_NODE_ID;
-        
-        typename std::conditional<
-            use_array,
-            std::array<item_id, max_items_per_node>,
-            std::vector<item_id>
-        >::type items_indices {};
+        uint8_t level = 0;
+        uint32_t count = 0;
+        leaf_block block;
     };
+    struct pool_node {
+        node_id parent_node_index = INVALID_NODE_ID;
+        node_id child_nodes_index = INVALID_NODE_ID;
+        typename pool_type::block_id items_block = pool_type::INVALID_BLOCK_ID;
+        uint32_t count : 24;
+        uint32_t level : 8;
+        pool_node(): count(0), level(0) {}
+    };
+    static_assert(sizeof(pool_node) == 16);
+    using node = std::conditional_t<leaf_storage == storage::vector, vector_node,
+                 std::conditional_t<leaf_storage == storage::array, array_node, pool_node>>;
 
     constexpr const static size_t root_level = std::numeric_limits<Coord>::digits - 1;
     //FIXME -1 because we can't express an area that covers the whole universe
+    using curve = morton::curve<Dimension, Coord, root_level>;
     area root_area;
 
-    std::vector<node> nodes;
-    std::vector<struct item> items;
-    std::unordered_map<your_id, item_id> index;
+    vector_type<node> nodes;
+    vector_type<struct item> items;
+    pool_type pool;
+    using index_type = flat::map<your_id, item_id, std::hash<your_id>, vector_type>;
+    //shared with snapshots until the next change to it, with copy_on_write
+    //its tables are chunked too so that change copies pointers, not entries
+    std::shared_ptr<index_type> index = std::make_shared<index_type>();
+    index_type& writable_index() {
+        unshare(index, [](const std::shared_ptr<index_type>& p) { return std::make_shared<index_type>(*p); });
+        return *index;
+    }
+
+    //blocks of num_child_nodes nodes and item slots released by merges and
+    //removals, reused before nodes/items grow
+    std::vector<node_id> free_node_blocks;
+    std::vector<item_id> free_items;
+    constexpr const static node_id FREE_NODE_ID = std::numeric_limits<node_id>::max();
+    //the file mapping chunks may point into when the tree was loaded by a
+    //mapped_file, held as one more owner so those chunks always read as
+    //shared and are copied before any write, never written in place
+    std::shared_ptr<const void> backing;
+    template<typename> friend struct mapped_file;
 
-    std::array<std::pair<node_id, area>, root_level + 1> stack;
-    size_t stack_valid_depth = 0;
+public:
+    //what the queries through one cursor did, counted only with_stats
+    //a descent starts from the deepest finger node shared with its
+    //position, descents_by_depth[d] counts those that started at depth d
+    struct query_stats {
+        size_t descents = 0;
+        size_t finger_resets = 0;
+        size_t nodes_visited = 0;
+        std::array<size_t, root_level + 1> descents_by_depth {};
+    };
+    struct no_stats {};
+    //a search finger owned by one caller: the nodes on the path to the last
+    //leaf it found, by depth, and scratch space reused by its queries
+    //node extents are implied by their level and the bits of any position
+    //inside them, so one position stands in for all of their areas
+    //const queries only write to the cursor passed in, so threads that
+    //each own a cursor can query one tree at the same time
+    struct cursor {
+        std::array<node_id, root_level + 1> stack {};
+        size_t valid_depth = 0;
+        Position finger {};
+        const tree* owner = nullptr;
+        size_t version = 0;
+        std::vector<std::pair<double, std::pair<node_id, area>>> queue {};
+        std::vector<std::pair<double, item_id>> best {};
+        std::conditional_t<with_stats, query_stats, no_stats> stats {};
+    };
+private:
+    //the cursor behind the overloads that take none
+    cursor own_cursor;
+    //bumped whenever node blocks are released, stale cursors start over
+    size_t version = 0;
+    struct change_stats {
+        size_t splits = 0;
+        size_t merges = 0;
+    };
+    std::conditional_t<with_stats, change_stats, no_stats> changes {};
 public:
 
     tree() {
         root_area.min = {};
         root_area.max.fill(Coord{1} << root_level);
         nodes.push_back({});
-        stack[0] = {INVALID_NODE_ID, root_area};
+        nodes[0].level = root_level;
     }
-    void split_node(node_id id, area a) {
-        node& parent = nodes[id];
-        parent.child_nodes_index = nodes.size();
-        for (size_t i = 0; i < num_child_nodes; i++) {
-            nodes.push_back({});
+    constexpr const static bool is_copy_on_write = copy_on_write;
+    //a read only copy of the current state for const queries
+    //with copy_on_write it shares every chunk with this tree
+    std::shared_ptr<const tree> snapshot() const {
+        return std::shared_ptr<const tree>(new tree(*this, snapshot_tag {}));
+    }
+private:
+    struct snapshot_tag {};
+    //free lists and the writer's cursor stay behind, a snapshot never changes
+    tree(const tree& other, snapshot_tag):
+        root_area(other.root_area),
+        nodes(other.nodes),
+        items(other.items),
+        index(other.index),
+        backing(other.backing),
+        version(other.version)
+    {
+        pool.chunks = other.pool.chunks;
+        pool.next = other.pool.next;
+    }
+public:
+    static double distance2(Position a, Position b) {
+        double d2 = 0;
+        for (size_t i = 0; i < Dimension; i++) {
+            Coord d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+            d2 += static_cast<double>(d) * static_cast<double>(d);
         }
-        parent = nodes[id];
-        assert(id < nodes.size());
-        //rebucket items
-        for (size_t i = 0; i < parent.items_indices.size(); i++) {
-            item_id id_ = parent.items_indices[i];
-            Position pos = items[id_].pos;
-            for (size_t j = 0; j < num_child_nodes; j++) {
-                area child_node_area = a.child(j);
-                if (child_node_area.contains(pos)) {
-                    node& child_node = nodes[parent.child_nodes_index + j];
-                    child_node.items_indices.push_back(id_);
+        return d2;
+    }
+    //the area of the node at level that contains p
+    static area node_area(Position p, size_t level) {
+        area a;
+        for (size_t i = 0; i < Dimension; i++) {
+            a.min[i] = p[i] & ~((Coord{1} << level) - 1);
+            a.max[i] = a.min[i] + (Coord{1} << level);
+        }
+        return a;
+    }
+    static size_t leaf_size(const node& n) {
+        if constexpr (leaf_storage == storage::vector) {
+            return n.items_indices.size();
+        } else {
+            return n.count;
+        }
+    }
+    template<typename F>
+    void for_each_leaf_item(const node& n, F&& f) const {
+        if constexpr (leaf_storage == storage::vector) {
+            for (item_id i: n.items_indices) {
+                f(i);
+            }
+        } else {
+            for_each_leaf_block(n, [&](const leaf_block& block, size_t count) {
+                for (size_t j = 0; j < count; j++) {
+                    f(block.ids[j]);
+                }
+            });
+        }
+    }
+    //calls f(block, count) for each block of an array or pool leaf
+    template<typename F>
+    void for_each_leaf_block(const node& n, F&& f) const {
+        if constexpr (leaf_storage == storage::array) {
+            f(n.block, n.count);
+        } else if constexpr (leaf_storage == storage::pool) {
+            size_t remaining = n.count;
+            for (auto b = n.items_block; remaining != 0; b = pool.next[b]) {
+                size_t m = std::min(remaining, max_items_per_node);
+                f(*pool[b], m);
+                remaining -= m;
+            }
+        }
+    }
+    //calls f(item_id) for the items of leaf n inside a, 64 slots at a time
+    //through the scan kernels where the leaf keeps position columns
+    template<typename F>
+    void for_each_leaf_item_within(const node& n, const area& a, F&& f) const {
+        if constexpr (leaf_storage == storage::vector) {
+            for_each_leaf_item(n, [&](item_id i) {
+                if (a.contains(items[i].pos)) {
+                    f(i);
+                }
+            });
+        } else {
+            for_each_leaf_block(n, [&](const leaf_block& block, size_t count) {
+                for (size_t g = 0; g < count; g += 64) {
+                    uint64_t mask = kernels::box_mask(block.columns.data() + g, leaf_block::stride, std::min<size_t>(64, count - g), a.min, a.max);
+                    for (; mask != 0; mask &= mask - 1) {
+                        f(block.ids[g + __builtin_ctzll(mask)]);
+                    }
+                }
+            });
+        }
+    }
+    //calls f(item_id) for the items of leaf n within distance r of center
+    template<typename F>
+    void for_each_leaf_item_within(const node& n, Position center, Coord r, F&& f) const {
+        if constexpr (leaf_storage == storage::vector) {
+            double r2 = static_cast<double>(r) * static_cast<double>(r);
+            for_each_leaf_item(n, [&](item_id i) {
+                if (distance2(items[i].pos, center) <= r2) {
+                    f(i);
+                }
+            });
+        } else {
+            for_each_leaf_block(n, [&](const leaf_block& block, size_t count) {
+                for (size_t g = 0; g < count; g += 64) {
+                    uint64_t mask = kernels::sphere_mask(block.columns.data() + g, leaf_block::stride, std::min<size_t>(64, count - g), center, r);
+                    for (; mask != 0; mask &= mask - 1) {
+                        f(block.ids[g + __builtin_ctzll(mask)]);
+                    }
+                }
+            });
+        }
+    }
+    //pool leaves beyond max_items_per_node (only possible at level 0) chain
+    //extra blocks, returns the block holding slot and its offset in it
+    std::pair<typename pool_type::block_id, size_t> pool_slot(const node& n, size_t slot) const {
+        auto b = n.items_block;
+        for (; slot >= max_items_per_node; slot -= max_items_per_node) {
+            b = pool.next[b];
+        }
+        return {b, slot};
+    }
+    void leaf_push(node_id id, item_id i) {
+        node& n = nodes[id];
+        if constexpr (leaf_storage == storage::vector) {
+            n.items_indices.push_back(i);
+        } else if constexpr (leaf_storage == storage::array) {
+            assert(n.count < max_items_per_node && "array storage holds at most max_items_per_node items per position");
+            n.block.set(n.count++, i, items[i].pos);
+        } else {
+            if (n.count == 0) {
+                n.items_block = pool.allocate();
+            } else if (n.count % max_items_per_node == 0) {
+                auto tail = pool_slot(n, n.count - 1).first;
+                pool.next[tail] = pool.allocate();
+            }
+            auto [b, j] = pool_slot(n, n.count);
+            pool[b]->set(j, i, items[i].pos);
+            assert(n.count + 1 < (1 << 24));
+            n.count++;
+        }
+    }
+    void leaf_erase(node_id id, item_id i) {
+        node& n = nodes[id];
+        if constexpr (leaf_storage == storage::vector) {
+            auto& v = n.items_indices;
+            *std::find(v.begin(), v.end(), i) = v.back();
+            v.pop_back();
+        } else if constexpr (leaf_storage == storage::array) {
+            size_t last = n.count - 1;
+            size_t j = std::find(n.block.ids.begin(), n.block.ids.begin() + last, i) - n.block.ids.begin();
+            n.block.set(j, n.block.ids[last], n.block.position(last));
+            n.count--;
+        } else {
+            auto [last_b, last_j] = pool_slot(n, n.count - 1);
+            const leaf_block& last_block = *std::as_const(pool)[last_b];
+            item_id last = last_block.ids[last_j];
+            Position last_pos = last_block.position(last_j);
+            for (size_t slot = 0; ; slot++) {
+                auto [b, j] = pool_slot(n, slot);
+                if (std::as_const(pool)[b]->ids[j] == i) {
+                    pool[b]->set(j, last, last_pos);
+                    break;
+                }
+            }
+            n.count--;
+            if (n.count == 0) {
+                pool.release(n.items_block);
+                n.items_block = pool_type::INVALID_BLOCK_ID;
+            } else if (n.count % max_items_per_node == 0) {
+                auto tail = pool_slot(n, n.count - 1).first;
+                pool.release(pool.next[tail]);
+                pool.next[tail] = pool_type::INVALID_BLOCK_ID;
+            }
+        }
+    }
+    //rewrites the stored position of item i after it moved inside leaf id
+    void leaf_move(node_id id, item_id i, const Position& p) {
+        if constexpr (leaf_storage == storage::array) {
+            node& n = nodes[id];
+            n.block.set(std::find(n.block.ids.begin(), n.block.ids.begin() + n.count, i) - n.block.ids.begin(), i, p);
+        } else if constexpr (leaf_storage == storage::pool) {
+            const node& n = nodes[id];
+            for (size_t slot = 0; ; slot++) {
+                auto [b, j] = pool_slot(n, slot);
+                if (std::as_const(pool)[b]->ids[j] == i) {
+                    pool[b]->set(j, i, p);
                     break;
                 }
             }
         }
-        parent.items_indices.clear();
     }
-    void maybe_merge_child_nodes(node& n) {
+    //empties a leaf and gives back its storage
+    void leaf_clear(node_id id) {
+        node& n = nodes[id];
+        if constexpr (leaf_storage == storage::vector) {
+            std::vector<item_id>().swap(n.items_indices);
+        } else if constexpr (leaf_storage == storage::array) {
+            n.count = 0;
+        } else {
+            for (auto b = n.items_block; b != pool_type::INVALID_BLOCK_ID;) {
+                auto next = pool.next[b];
+                pool.release(b);
+                b = next;
+            }
+            n.items_block = pool_type::INVALID_BLOCK_ID;
+            n.count = 0;
+        }
+    }
+    void split_node(node_id id) {
+        node_id child_nodes_index;
+        if (!free_node_blocks.empty()) {
+            child_nodes_index = free_node_blocks.back();
+            free_node_blocks.pop_back();
+        } else {
+            child_nodes_index = nodes.size();
+            nodes.resize(nodes.size() + num_child_nodes);
+        }
+        for (size_t i = 0; i < num_child_nodes; i++) {
+            node& child = nodes[child_nodes_index + i];
+            child.parent_node_index = id;
+            child.level = nodes[id].level - 1;
+        }
+        assert(id < nodes.size());
+        node& parent = nodes[id];
+        parent.child_nodes_index = child_nodes_index;
+        //rebucket items
+        for_each_leaf_item(parent, [&](item_id i) {
+            size_t c = child_index(items[i].pos, parent.level);
+            leaf_push(child_nodes_index + c, i);
+            items[i].node_index = child_nodes_index + c;
+        });
+        leaf_clear(id);
+        if constexpr (with_stats) {
+            changes.splits++;
+        }
+    }
+    //folds the children of id back into it if they are all leaves and
+    //hold no more than max_items_per_node items between them
+    bool maybe_merge_child_nodes(node_id id) {
+        node_id child_nodes_index = nodes[id].child_nodes_index;
+        if (child_nodes_index == INVALID_NODE_ID) {
+            return false;
+        }
         size_t num_items = 0;
         for (size_t i = 0; i < num_child_nodes; i++) {
-            num_items += nodes[n.child_node_index + i].items_indices.size();
+            const node& c = nodes[child_nodes_index + i];
+            if (c.child_nodes_index != INVALID_NODE_ID) {
+                return false;
+            }
+            num_items += leaf_size(c);
         }
         if (num_items > max_items_per_node) {
-            return;
+            return false;
         }
         //rebucket items
+        nodes[id].child_nodes_index = INVALID_NODE_ID;
         for (size_t i = 0; i < num_child_nodes; i++) {
-            node& c = nodes[n.child_node_index + i];
-            n.items_indices.insert(c.items_indices);
-            c.~items_indices();
+            for_each_leaf_item(nodes[child_nodes_index + i], [&](item_id item) {
+                leaf_push(id, item);
+                items[item].node_index = id;
+            });
+            leaf_clear(child_nodes_index + i);
+            nodes[child_nodes_index + i] = {};
+        }
+        free_node_blocks.push_back(child_nodes_index);
+        //cursors must not point into the released block
+        version++;
+        if constexpr (with_stats) {
+            changes.merges++;
+        }
+        return true;
+    }
+    void merge_upwards(node_id id) {
+        while (maybe_merge_child_nodes(id) && id != 0) {
+            id = nodes[id].parent_node_index;
         }
-        n.child_node_index = INVALID_NODE_ID;
     }
-    std::optional<item_id> find_item(your_id id) {
+    std::optional<item_id> find_item(your_id id) const {
         if (true) {
-            auto search = index.find(id);
-            if (search != index.end()) {
-                return {search->second};
+            const item_id* search = index->find(id);
+            if (search != nullptr) {
+                return {*search};
             } else {
                 return std::nullopt;
             }
@@ -172,8 +710,32 @@ public:
             return std::nullopt;
         }
     }
-    std::pair<node_id, area> find_node(your_id id) {
-        find_item(id);
+    //the leaf holding the item with id, found through the item's back
+    //reference rather than a descent
+    //the path up to the root is loaded into the cursor, so a query around
+    //the item's position straight after starts at its leaf
+    std::optional<std::tuple<node_id, area, size_t>> find_node(cursor& c, your_id id) const {
+        std::optional<item_id> i = find_item(id);
+        if (!i) {
+            return std::nullopt;
+        }
+        const item& it = items[*i];
+        node_id leaf = it.node_index;
+        size_t level = nodes[leaf].level;
+        c.owner = this;
+        c.version = version;
+        c.finger = it.pos;
+        c.valid_depth = level_to_depth(level);
+        node_id n = leaf;
+        for (size_t depth = c.valid_depth; depth > 0; depth--) {
+            c.stack[depth] = n;
+            n = nodes[n].parent_node_index;
+        }
+        c.stack[0] = n;
+        return std::tuple<node_id, area, size_t> {leaf, node_area(it.pos, level), level};
+    }
+    std::optional<std::tuple<node_id, area, size_t>> find_node(your_id id) {
+        return find_node(own_cursor, id);
     }
 private:
     static size_t msb(unsigned t) {
@@ -204,140 +766,1284 @@ private:
         return msb(bits);
     }
 public:
-    static bool morton_compare(const Position &a, const Position &b) {
-        size_t bit = highest_bit_different(a, b);
-        size_t bits_a = 0;
-        size_t bits_b = 0;
+    //a morton sorted range splits into contiguous children
+    static size_t child_index(const Position& p, size_t level) {
+        size_t index = 0;
         for (size_t i = 0; i < Dimension; i++) {
-            bits_a <<= 1;
-            bits_b <<= 1;
-            bits_a |= (a[i] >> bit) & 1;
-            bits_b |= (b[i] >> bit) & 1;
+            index |= ((p[i] >> (level - 1)) & 1) << i;
         }
-        return bits_a < bits_b;
+        return index;
+    }
+    static bool morton_compare(const Position &a, const Position &b) {
+        return curve::compare(a, b);
     }
-    size_t depth_to_level(size_t depth) {
+    static size_t depth_to_level(size_t depth) {
         assert(depth <= root_level);
         return root_level - depth;
     }
-    size_t level_to_depth(size_t level) {
+    static size_t level_to_depth(size_t level) {
         assert(level <= root_level);
         return root_level - level;
     }
 private:
-    void check_stack() {
-        size_t check_depth;
-        for (check_depth = 0; check_depth <= stack_valid_depth; check_depth++) {
-            auto area = stack[check_depth].second;
-            Coord size = area.max[0] - area.min[0];
-            for (size_t i = 1; i < Dimension; i++) {
-                assert(area.max[i] - area.min[i] == size);
-            }
-            assert(size == (static_cast<Coord>(1) << depth_to_level(check_depth)));
+    void check_stack(const cursor& c) const {
+        for (size_t check_depth = 0; check_depth <= c.valid_depth; check_depth++) {
+            assert(nodes[c.stack[check_depth]].level == depth_to_level(check_depth));
+            assert(check_depth == 0 || nodes[c.stack[check_depth]].parent_node_index == c.stack[check_depth - 1]);
         }
     }
-    size_t get_ancestor_depth(Position position) {
-        auto [_, ancestor_area] = stack[stack_valid_depth];
-        size_t b = highest_bit_different(ancestor_area.min, position);
+    size_t get_ancestor_depth(cursor& c, Position position) const {
+        if (c.owner != this || c.version != version) {
+            if constexpr (with_stats) {
+                c.stats.finger_resets++;
+            }
+            c.owner = this;
+            c.version = version;
+            c.valid_depth = 0;
+            c.stack[0] = 0;
+            return 0;
+        }
+        size_t b = highest_bit_different(c.finger, position);
         size_t level = b != -1ULL ? b + 1 : 0;
         size_t depth = level_to_depth(level);
-        size_t valid_depth = std::min(depth, stack_valid_depth);
+        size_t valid_depth = std::min(depth, c.valid_depth);
         if (false) {
-            {
-                size_t expected_size = static_cast<Coord>(1) << depth_to_level(valid_depth);
-                auto area = stack[valid_depth].second;
-                size_t got_size = area.max[0] - area.min[0];
-                assert(got_size == expected_size);
-            }
-            check_stack();
+            check_stack(c);
         }
-        assert(stack[valid_depth].second.contains(position));
         return valid_depth;
     }
-public:
-    std::tuple<node_id, area, size_t> find_node(Position position) {
-        size_t cur_node_id;
-        area cur_node_area;
-        size_t depth;
-        if (true) {
-            depth = get_ancestor_depth(position);
-            std::tie(cur_node_id, cur_node_area) = stack[depth];
-            assert(cur_node_area.contains(position));
-        } else {
-            cur_node_id = 0;
-            cur_node_area = root_area;
-            depth = 0;
+    //the node containing position at stop_level, or the leaf above it
+    std::tuple<node_id, area, size_t> descend(cursor& c, Position position, size_t stop_level) const {
+        size_t depth = std::min(get_ancestor_depth(c, position), level_to_depth(stop_level));
+        size_t start_depth = depth;
+        if constexpr (with_stats) {
+            c.stats.descents++;
+            c.stats.descents_by_depth[depth]++;
         }
+        node_id cur_node_id = c.stack[depth];
+        size_t level = depth_to_level(depth);
         while (true) {
-            node& n = nodes[cur_node_id];
-            if (n.child_nodes_index == INVALID_NODE_ID) {
+            node_id child_nodes_index = nodes[cur_node_id].child_nodes_index;
+            if (child_nodes_index == INVALID_NODE_ID || level == stop_level) {
                 //found leaf
-                return {cur_node_id, cur_node_area, depth_to_level(depth)};
-            } else {
-                //traverse
-                auto [child_area, child_offset] = cur_node_area.child(position);
-                cur_node_id = n.child_nodes_index + child_offset;
-                cur_node_area = child_area;
-                depth++;
-                stack[depth] = {cur_node_id, cur_node_area};
-                stack_valid_depth = depth;
+                if constexpr (with_stats) {
+                    c.stats.nodes_visited += depth - start_depth + 1;
+                }
+                c.valid_depth = depth;
+                c.finger = position;
+                return {cur_node_id, node_area(position, level), level};
             }
+            //traverse
+            cur_node_id = child_nodes_index + child_index(position, level);
+            level--;
+            depth++;
+            c.stack[depth] = cur_node_id;
         }
     }
+public:
+    //descends from the deepest finger node shared with position, picking
+    //each child from one bit per dimension of position
+    std::tuple<node_id, area, size_t> find_node(cursor& c, Position position) const {
+        return descend(c, position, 0);
+    }
+    std::tuple<node_id, area, size_t> find_node(Position position) {
+        return find_node(own_cursor, position);
+    }
     void reserve(size_t n) {
         nodes.reserve(n);
         items.reserve(n);
     }
+    //bulk insert: sorts is in morton order, appends it to items and merges
+    //it into the tree top down, so every node is visited once per batch
+    //rather than once per item
+    //on an empty tree this builds the whole node array in one pass
     void insert_items(std::vector<item>& is) {
-        std::sort(is.begin(), is.end(),
-            [](const auto& a, const auto& b) -> bool {
-                return morton_compare(a.pos, b.pos);
+        curve::sort(is, [](const item& i) { return i.pos; });
+        merge_sorted(is);
+    }
+    //bulk insert with the work spread over threads
+    //an empty tree is built in parallel: the top of the tree is laid out
+    //serially, the subtrees below it are built by separate tasks into their
+    //own node arrays and copied into the slots the serial build would have
+    //given them, so both builds produce the same tree
+    //a tree that already holds items only sorts in parallel
+    void insert_items(std::vector<item>& is, parallel::thread_pool& threads) {
+        curve::sort(is, [](const item& i) { return i.pos; }, threads);
+        if (!items.empty()) {
+            merge_sorted(is);
+            return;
+        }
+        items.reserve(is.size());
+        index_type& ids = writable_index();
+        for (auto& i: is) {
+            if (!root_area.contains(i.pos)) {
+                std::cerr << "warning: cannot insert_item " << i.id << " with position out of bounds" << std::endl;
+                continue;
             }
-        );
+            ids[i.id] = items.size();
+            items.push_back({i.pos, i.id, INVALID_NODE_ID});
+        }
+        build(threads);
+    }
+private:
+    void merge_sorted(const std::vector<item>& is) {
+        std::vector<item_id> ids;
+        ids.reserve(is.size());
+        items.reserve(items.size() + is.size() - std::min(is.size(), free_items.size()));
+        index_type& writable = writable_index();
         for (auto& i: is) {
-            insert_item(i.id, i.pos);
+            if (!root_area.contains(i.pos)) {
+                std::cerr << "warning: cannot insert_item " << i.id << " with position out of bounds" << std::endl;
+                continue;
+            }
+            item_id id = allocate_item({i.pos, i.id, INVALID_NODE_ID});
+            writable[i.id] = id;
+            ids.push_back(id);
+        }
+        merge_items(0, root_level, ids.begin(), ids.end());
+    }
+    item_id allocate_item(const item& i) {
+        if (!free_items.empty()) {
+            item_id id = free_items.back();
+            free_items.pop_back();
+            items[id] = i;
+            return id;
+        }
+        items.push_back(i);
+        return items.size() - 1;
+    }
+    using id_iterator = typename std::vector<item_id>::const_iterator;
+    //merges the morton sorted items [first, last) into the subtree at id
+    void merge_items(node_id id, size_t level, id_iterator first, id_iterator last) {
+        if (nodes[id].child_nodes_index == INVALID_NODE_ID) {
+            size_t count = leaf_size(nodes[id]) + (last - first);
+            if (count <= max_items_per_node || level == 0) {
+                for (; first != last; ++first) {
+                    leaf_push(id, *first);
+                    items[*first].node_index = id;
+                }
+                return;
+            }
+            split_node(id);
+        }
+        node_id child_nodes_index = nodes[id].child_nodes_index;
+        for (size_t c = 0; c < num_child_nodes; c++) {
+            id_iterator child_last = std::partition_point(first, last,
+                [&](item_id i) { return child_index(items[i].pos, level) <= c; }
+            );
+            //recurse on empty ranges too, a child split_node overfilled
+            //still needs to be split
+            if (first != child_last || leaf_size(nodes[child_nodes_index + c]) > max_items_per_node) {
+                merge_items(child_nodes_index + c, level - 1, first, child_last);
+            }
+            first = child_last;
         }
     }
+
+    //a node of a parallel build subtree, ids are local to the subtree
+    //leaves hold the sorted items [first, first + count)
+    struct build_node {
+        node_id parent_node_index = INVALID_NODE_ID;
+        node_id child_nodes_index = INVALID_NODE_ID;
+        size_t level = 0;
+        item_id first = 0;
+        item_id count = 0;
+    };
+    //one subtree of a parallel build, nodes[0] is its root
+    struct build_task {
+        size_t level;
+        item_id first;
+        item_id last;
+        std::vector<build_node> nodes {};
+        std::vector<node_id> leaves {}; //in the order merge_items fills them
+        node_id root = INVALID_NODE_ID;
+        node_id base = INVALID_NODE_ID; //where nodes[1] lands
+        typename pool_type::block_id first_block = 0;
+    };
+    //end of the items of child c among the sorted items [first, last)
+    item_id child_end(size_t level, size_t c, item_id first, item_id last) const {
+        while (first < last) {
+            item_id mid = first + (last - first) / 2;
+            if (child_index(items[mid].pos, level) <= c) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+        return first;
+    }
+    //visits the top of a parallel build, the nodes above grain items, in
+    //the order merge_items would, and calls f(id, level, first, last) for
+    //each subtree hanging off it
+    //with split the top nodes are allocated as merge_items would too
+    template<typename F>
+    void walk_build_top(node_id id, size_t level, item_id first, item_id last, size_t grain, bool split, F&& f) {
+        if (last - first <= grain || level == 0) {
+            f(id, level, first, last);
+            return;
+        }
+        if (split) {
+            split_node(id);
+        }
+        for (size_t c = 0; c < num_child_nodes; c++) {
+            item_id child_last = child_end(level, c, first, last);
+            if (first != child_last) {
+                walk_build_top(split ? nodes[id].child_nodes_index + c : INVALID_NODE_ID, level - 1, first, child_last, grain, split, f);
+            }
+            first = child_last;
+        }
+    }
+    //merge_items on an empty subtree, writing local nodes
+    void build_subtree(build_task& t, node_id local, size_t level, item_id first, item_id last) const {
+        if (last - first <= max_items_per_node || level == 0) {
+            t.nodes[local].first = first;
+            t.nodes[local].count = last - first;
+            t.leaves.push_back(local);
+            return;
+        }
+        node_id child_nodes_index = t.nodes.size();
+        t.nodes.resize(t.nodes.size() + num_child_nodes);
+        t.nodes[local].child_nodes_index = child_nodes_index;
+        for (size_t c = 0; c < num_child_nodes; c++) {
+            t.nodes[child_nodes_index + c].parent_node_index = local;
+            t.nodes[child_nodes_index + c].level = level - 1;
+        }
+        for (size_t c = 0; c < num_child_nodes; c++) {
+            item_id child_last = child_end(level, c, first, last);
+            if (first != child_last) {
+                build_subtree(t, child_nodes_index + c, level - 1, first, child_last);
+            }
+            first = child_last;
+        }
+    }
+    //fills a leaf with the sorted items [first, first + count), pool
+    //leaves take consecutive blocks starting at block
+    void fill_leaf(node_id id, item_id first, item_id count, typename pool_type::block_id block) {
+        node& n = nodes[id];
+        if constexpr (leaf_storage == storage::vector) {
+            n.items_indices.resize(count);
+            std::iota(n.items_indices.begin(), n.items_indices.end(), first);
+        } else if constexpr (leaf_storage == storage::array) {
+            assert(count <= max_items_per_node && "array storage holds at most max_items_per_node items per position");
+            for (size_t j = 0; j < count; j++) {
+                n.block.set(j, first + j, items[first + j].pos);
+            }
+            n.count = count;
+        } else {
+            n.count = count;
+            if (count != 0) {
+                n.items_block = block;
+            }
+            for (size_t remaining = count; remaining != 0; block++) {
+                size_t m = std::min(remaining, max_items_per_node);
+                leaf_block& b = *pool[block];
+                for (size_t j = 0; j < m; j++) {
+                    b.set(j, first + j, items[first + j].pos);
+                }
+                first += m;
+                remaining -= m;
+                if (remaining != 0) {
+                    pool.next[block] = block + 1;
+                }
+            }
+        }
+    }
+    //builds the nodes of an empty tree over the sorted items
+    void build(parallel::thread_pool& threads) {
+        size_t grain = std::max(max_items_per_node, items.size() / (threads.size() * 16));
+        std::vector<build_task> tasks;
+        walk_build_top(0, root_level, 0, items.size(), grain, false, [&](node_id, size_t level, item_id first, item_id last) {
+            tasks.push_back({level, first, last});
+        });
+        threads.parallel_for(tasks.size(), [&](size_t t) {
+            build_task& task = tasks[t];
+            task.nodes.resize(1);
+            task.nodes[0].level = task.level;
+            build_subtree(task, 0, task.level, task.first, task.last);
+        });
+        //lay out the top and make room for each subtree in serial order
+        size_t next_task = 0;
+        size_t num_blocks = 0;
+        walk_build_top(0, root_level, 0, items.size(), grain, true, [&](node_id id, size_t, item_id, item_id) {
+            build_task& task = tasks[next_task++];
+            task.root = id;
+            task.base = nodes.size();
+            nodes.resize(nodes.size() + task.nodes.size() - 1);
+            task.first_block = num_blocks;
+            for (node_id local: task.leaves) {
+                num_blocks += (task.nodes[local].count + max_items_per_node - 1) / max_items_per_node;
+            }
+        });
+        if constexpr (leaf_storage == storage::pool) {
+            for (size_t b = 0; b < num_blocks; b++) {
+                [[maybe_unused]] auto block = pool.allocate();
+                assert(block == b);
+            }
+        }
+        //the tasks below write chunks side by side, copy any shared ones first
+        if constexpr (copy_on_write) {
+            nodes.unshare_all();
+            items.unshare_all();
+            pool.unshare_all();
+        }
+        threads.parallel_for(tasks.size(), [&](size_t t) {
+            const build_task& task = tasks[t];
+            auto global = [&](node_id local) -> node_id {
+                return local == 0 ? task.root : task.base + local - 1;
+            };
+            for (node_id local = 0; local < task.nodes.size(); local++) {
+                const build_node& b = task.nodes[local];
+                node& n = nodes[global(local)];
+                if (local != 0) {
+                    n.parent_node_index = global(b.parent_node_index);
+                    n.level = b.level;
+                }
+                if (b.child_nodes_index != INVALID_NODE_ID) {
+                    n.child_nodes_index = global(b.child_nodes_index);
+                }
+            }
+            auto block = task.first_block;
+            for (node_id local: task.leaves) {
+                const build_node& b = task.nodes[local];
+                node_id id = global(local);
+                for (item_id i = b.first; i < b.first + b.count; i++) {
+                    items[i].node_index = id;
+                }
+                fill_leaf(id, b.first, b.count, block);
+                block += (b.count + max_items_per_node - 1) / max_items_per_node;
+            }
+        });
+    }
+public:
     item_id insert_item(your_id data, Position position) {
         if (!root_area.contains(position)) {
             std::cerr << "warning: cannot insert_item " << data << " with position out of bounds" << std::endl;
             return -1;
         }
-        item_id id = items.size();
-        items.push_back({position, data, id});
-        auto [node_id, node_area, node_level] = find_node(position);
-        node& n = nodes[node_id];
-        //found leaf
-        if (n.items_indices.size() < max_items_per_node || node_level == 0) {
-            //insert
-            n.items_indices.push_back(id);
-        } else {
-            split_node(node_id, node_area);
-            n = nodes[node_id];
-            for (size_t j = 0; j < num_child_nodes; j++) {
-                area child_node_area = node_area.child(j);
-                if (child_node_area.contains(position)) {
-                    node& child_node = nodes[n.child_nodes_index + j];
-                    child_node.items_indices.push_back(id);
-                    break;
+        item_id id = allocate_item({position, data, INVALID_NODE_ID});
+        writable_index()[data] = id;
+        while (true) {
+            auto [node_id, _, node_level] = find_node(position);
+            node& n = nodes[node_id];
+            //found leaf
+            if (leaf_size(n) < max_items_per_node || node_level == 0) {
+                //insert
+                leaf_push(node_id, id);
+                items[id].node_index = node_id;
+                return id;
+            }
+            //split and descend again from the same node
+            split_node(node_id);
+        }
+    }
+
+    //moves items to new positions in one batch
+    //an item that stays inside its leaf is only rewritten; one that leaves
+    //it walks up the parents to the lowest node still containing the new
+    //position and descends from there, so nearby moves touch few nodes
+    //leaves that overflow are split once at the end of the batch
+    void update_positions(const std::vector<std::pair<your_id, Position>>& moves) {
+        std::vector<node_id> overfull;
+        std::vector<node_id> emptied;
+        for (auto& [data, position]: moves) {
+            const item_id* search = index->find(data);
+            if (search == nullptr) {
+                continue;
+            }
+            if (!root_area.contains(position)) {
+                std::cerr << "warning: cannot move item " << data << " to position out of bounds" << std::endl;
+                continue;
+            }
+            item_id id = *search;
+            item& it = items[id];
+            node_id leaf = it.node_index;
+            size_t b = highest_bit_different(it.pos, position);
+            it.pos = position;
+            if (b == static_cast<size_t>(-1)) {
+                continue;
+            }
+            if (b < nodes[leaf].level) {
+                leaf_move(leaf, id, position);
+                continue;
+            }
+            node_id target = nodes[leaf].parent_node_index;
+            while (nodes[target].level <= b) {
+                target = nodes[target].parent_node_index;
+            }
+            while (true) {
+                while (nodes[target].child_nodes_index != INVALID_NODE_ID) {
+                    target = nodes[target].child_nodes_index + child_index(position, nodes[target].level);
+                }
+                //inline arrays cannot overflow until the end of the batch
+                if constexpr (leaf_storage == storage::array) {
+                    if (leaf_size(nodes[target]) == max_items_per_node && nodes[target].level > 0) {
+                        split_node(target);
+                        continue;
+                    }
                 }
+                break;
+            }
+            leaf_erase(leaf, id);
+            if (leaf != 0) {
+                emptied.push_back(nodes[leaf].parent_node_index);
+            }
+            leaf_push(target, id);
+            it.node_index = target;
+            if (leaf_size(nodes[target]) == max_items_per_node + 1 && nodes[target].level > 0) {
+                overfull.push_back(target);
             }
         }
-        return id;
+        for (node_id id: emptied) {
+            merge_upwards(id);
+        }
+        for (node_id id: overfull) {
+            split_overfull(id);
+        }
+    }
+private:
+    void split_overfull(node_id id) {
+        node& n = nodes[id];
+        if (n.child_nodes_index != INVALID_NODE_ID || leaf_size(n) <= max_items_per_node || n.level == 0) {
+            return;
+        }
+        split_node(id);
+        for (size_t c = 0; c < num_child_nodes; c++) {
+            split_overfull(nodes[id].child_nodes_index + c);
+        }
     }
+public:
 
-    void remove_item(item_id id);
+    void remove_item(item_id id) {
+        assert(id < items.size() && items[id].node_index != FREE_NODE_ID);
+        item& it = items[id];
+        node_id leaf = it.node_index;
+        leaf_erase(leaf, id);
+        index_type& writable = writable_index();
+        const item_id* search = writable.find(it.id);
+        if (search != nullptr && *search == id) {
+            writable.erase(it.id);
+        }
+        it.node_index = FREE_NODE_ID;
+        free_items.push_back(id);
+        if (leaf != 0) {
+            merge_upwards(nodes[leaf].parent_node_index);
+        }
+    }
     node& get_node(item_id id);
     std::vector<item&> get_items(node n);
-    std::vector<item_id> get_items_within_area(area a);
 
-    void post_insert_check() {
+    const item& get_item(item_id id) const {
+        return items[id];
+    }
+
+private:
+    //calls f(item_id) for every item of the subtree at start inside a
+    //returns the nodes it visited, counted only with_stats
+    template<typename F>
+    size_t scan_area(node_id start, const area& start_area, const area& a, F&& f) const {
+        //one frame per depth, so the traversal needs no heap allocation
+        struct frame {
+            node_id id;
+            area node_area;
+            bool covered;
+            size_t next_child;
+        };
+        std::array<frame, root_level + 1> frames;
+        frames[0] = {start, start_area, a.contains(start_area), 0};
+        size_t depth = 0;
+        size_t visited = 0;
+        while (true) {
+            frame& fr = frames[depth];
+            const node& n = nodes[fr.id];
+            if constexpr (with_stats) {
+                visited += fr.next_child == 0;
+            }
+            if (n.child_nodes_index == INVALID_NODE_ID) {
+                //leaf
+                if (fr.covered) {
+                    for_each_leaf_item(n, f);
+                } else {
+                    for_each_leaf_item_within(n, a, f);
+                }
+                fr.next_child = num_child_nodes;
+            }
+            if (fr.next_child == num_child_nodes) {
+                if (depth == 0) {
+                    return visited;
+                }
+                depth--;
+                continue;
+            }
+            size_t c = fr.next_child++;
+            area child_area = fr.node_area.child(c);
+            if (fr.covered || a.overlaps(child_area)) {
+                frames[depth + 1] = {
+                    static_cast<node_id>(n.child_nodes_index + c),
+                    child_area,
+                    fr.covered || a.contains(child_area),
+                    0
+                };
+                depth++;
+            }
+        }
+    }
+public:
+    //calls f(item_id) for every item inside a
+    //subtrees fully inside a are reported without testing their items
+    template<typename F>
+    void for_each_item_within_area(const area& a, F&& f) const {
+        if (a.overlaps(root_area)) {
+            scan_area(0, root_area, a, f);
+        }
+    }
+    //the same, starting from the smallest node that holds all of a, found
+    //from the cursor's finger rather than the root
+    template<typename F>
+    void for_each_item_within_area(cursor& c, const area& a, F&& f) const {
+        if (!a.overlaps(root_area)) {
+            return;
+        }
+        Position lo;
+        Position hi;
+        for (size_t i = 0; i < Dimension; i++) {
+            lo[i] = std::max(a.min[i], root_area.min[i]);
+            hi[i] = std::min(a.max[i], root_area.max[i]) - 1;
+        }
+        size_t b = highest_bit_different(lo, hi);
+        size_t level = b != -1ULL ? b + 1 : 0;
+        auto [start, start_area, start_level] = descend(c, lo, level);
+        size_t visited = scan_area(start, start_area, a, f);
+        if constexpr (with_stats) {
+            c.stats.nodes_visited += visited - 1;
+        }
+    }
+    template<typename OutputIt>
+    OutputIt get_items_within_area(cursor& c, const area& a, OutputIt out) const {
+        for_each_item_within_area(c, a, [&](item_id i) {
+            *out++ = i;
+        });
+        return out;
+    }
+    template<typename OutputIt>
+    OutputIt get_items_within_area(const area& a, OutputIt out) const {
+        for_each_item_within_area(a, [&](item_id i) {
+            *out++ = i;
+        });
+        return out;
+    }
+    std::vector<item_id> get_items_within_area(const area& a) const {
+        std::vector<item_id> out;
+        get_items_within_area(a, std::back_inserter(out));
+        return out;
+    }
+
+private:
+    //visits nodes in increasing box distance from position, calling
+    //on_leaf(node_id) for each leaf until the closest remaining node is
+    //farther than bound()
+    //the descent starts at the leaf under the search finger: that leaf and
+    //the siblings of each of its ancestors on the stack cover the whole tree
+    template<typename Bound, typename F>
+    void visit_nodes_by_distance(cursor& cur, Position position, Bound&& bound, F&& on_leaf) const {
+        using entry = std::pair<double, std::pair<node_id, area>>;
+        auto farther = [](const entry& a, const entry& b) {
+            return a.first > b.first;
+        };
+        std::vector<entry>& queue = cur.queue;
+        queue.clear();
+        if (root_area.contains(position)) {
+            auto [leaf_id, leaf_area, leaf_level] = find_node(cur, position);
+            queue.push_back({0, {leaf_id, leaf_area}});
+            for (size_t depth = level_to_depth(leaf_level); depth > 0; depth--) {
+                node_id parent_id = cur.stack[depth - 1];
+                area parent_area = node_area(position, depth_to_level(depth - 1));
+                node_id path_child = cur.stack[depth];
+                node_id first_child = nodes[parent_id].child_nodes_index;
+                for (size_t c = 0; c < num_child_nodes; c++) {
+                    if (first_child + c == path_child) {
+                        continue;
+                    }
+                    area child_area = parent_area.child(c);
+                    queue.push_back({child_area.distance2(position), {static_cast<node_id>(first_child + c), child_area}});
+                }
+            }
+            std::make_heap(queue.begin(), queue.end(), farther);
+        } else {
+            queue.push_back({root_area.distance2(position), {0, root_area}});
+        }
+        while (!queue.empty()) {
+            std::pop_heap(queue.begin(), queue.end(), farther);
+            auto [d2, entry_node] = queue.back();
+            auto [id, node_area] = entry_node;
+            queue.pop_back();
+            if (d2 > bound()) {
+                break;
+            }
+            if constexpr (with_stats) {
+                cur.stats.nodes_visited++;
+            }
+            const node& n = nodes[id];
+            if (n.child_nodes_index == INVALID_NODE_ID) {
+                on_leaf(id);
+                continue;
+            }
+            for (size_t c = 0; c < num_child_nodes; c++) {
+                area child_area = node_area.child(c);
+                double child_d2 = child_area.distance2(position);
+                if (child_d2 <= bound()) {
+                    queue.push_back({child_d2, {static_cast<node_id>(n.child_nodes_index + c), child_area}});
+                    std::push_heap(queue.begin(), queue.end(), farther);
+                }
+            }
+        }
+    }
+public:
+    //writes the ids of the k items closest to position, closest first
+    template<typename OutputIt>
+    OutputIt nearest(cursor& c, Position position, size_t k, OutputIt out) const {
+        if (k == 0) {
+            return out;
+        }
+        //bounded max-heap of the best k candidates so far
+        std::vector<std::pair<double, item_id>>& best = c.best;
+        best.clear();
+        best.reserve(k);
+        auto bound = [&]() {
+            return best.size() < k ? std::numeric_limits<double>::infinity() : best.front().first;
+        };
+        visit_nodes_by_distance(c, position, bound, [&](node_id id) {
+            for_each_leaf_item(nodes[id], [&](item_id i) {
+                double d2 = distance2(items[i].pos, position);
+                if (best.size() < k) {
+                    best.push_back({d2, i});
+                    std::push_heap(best.begin(), best.end());
+                } else if (d2 < best.front().first) {
+                    std::pop_heap(best.begin(), best.end());
+                    best.back() = {d2, i};
+                    std::push_heap(best.begin(), best.end());
+                }
+            });
+        });
+        std::sort_heap(best.begin(), best.end());
+        for (auto& b: best) {
+            *out++ = b.second;
+        }
+        return out;
+    }
+    std::vector<item_id> nearest(cursor& c, Position position, size_t k) const {
+        std::vector<item_id> out;
+        nearest(c, position, k, std::back_inserter(out));
+        return out;
+    }
+    template<typename OutputIt>
+    OutputIt nearest(Position position, size_t k, OutputIt out) {
+        return nearest(own_cursor, position, k, out);
+    }
+    std::vector<item_id> nearest(Position position, size_t k) {
+        return nearest(own_cursor, position, k);
+    }
+    //calls f(item_id) for every item within distance r of position
+    template<typename F>
+    void for_each_item_within_radius(cursor& c, Position position, Coord r, F&& f) const {
+        double r2 = static_cast<double>(r) * static_cast<double>(r);
+        visit_nodes_by_distance(c, position, [r2]() { return r2; }, [&](node_id id) {
+            for_each_leaf_item_within(nodes[id], position, r, f);
+        });
+    }
+    template<typename F>
+    void for_each_item_within_radius(Position position, Coord r, F&& f) {
+        for_each_item_within_radius(own_cursor, position, r, f);
+    }
+    template<typename OutputIt>
+    OutputIt within_radius(cursor& c, Position position, Coord r, OutputIt out) const {
+        for_each_item_within_radius(c, position, r, [&](item_id i) {
+            *out++ = i;
+        });
+        return out;
+    }
+    std::vector<item_id> within_radius(cursor& c, Position position, Coord r) const {
+        std::vector<item_id> out;
+        within_radius(c, position, r, std::back_inserter(out));
+        return out;
+    }
+    template<typename OutputIt>
+    OutputIt within_radius(Position position, Coord r, OutputIt out) {
+        return within_radius(own_cursor, position, r, out);
+    }
+    std::vector<item_id> within_radius(Position position, Coord r) {
+        return within_radius(own_cursor, position, r);
+    }
+
+private:
+    //runs query(q, out) for each q in [0, n) in morton order of
+    //position_of(q), so each descent starts from the finger the previous,
+    //nearby query left in the cursor, then puts the answers back in q order
+    template<typename T, typename PositionOf, typename Query>
+    static batch_results<T> run_batch(size_t n, PositionOf position_of, Query query) {
+        std::vector<size_t> order(n);
+        std::iota(order.begin(), order.end(), 0);
+        curve::sort(order, position_of);
+        std::vector<T> scratch;
+        std::vector<std::pair<size_t, size_t>> ranges(n);
+        for (size_t q: order) {
+            size_t first = scratch.size();
+            query(q, std::back_inserter(scratch));
+            ranges[q] = {first, scratch.size()};
+        }
+        batch_results<T> out;
+        out.offsets.reserve(n + 1);
+        out.values.reserve(scratch.size());
+        for (auto [first, last]: ranges) {
+            out.values.insert(out.values.end(), scratch.begin() + first, scratch.begin() + last);
+            out.offsets.push_back(out.values.size());
+        }
+        return out;
+    }
+public:
+    //batched queries: the same answers as one call per query, in the order
+    //of the queries, with the queries run in morton order
+    std::vector<std::tuple<node_id, area, size_t>> batch_find_node(cursor& c, const std::vector<Position>& positions) const {
+        std::vector<size_t> order(positions.size());
+        std::iota(order.begin(), order.end(), 0);
+        curve::sort(order, [&](size_t q) { return positions[q]; });
+        std::vector<std::tuple<node_id, area, size_t>> out(positions.size());
+        for (size_t q: order) {
+            out[q] = find_node(c, positions[q]);
+        }
+        return out;
+    }
+    batch_results<item_id> batch_get_items_within_area(cursor& c, const std::vector<area>& areas) const {
+        return run_batch<item_id>(areas.size(), [&](size_t q) { return areas[q].min; }, [&](size_t q, auto out) {
+            get_items_within_area(c, areas[q], out);
+        });
+    }
+    batch_results<item_id> batch_within_radius(cursor& c, const std::vector<Position>& positions, Coord r) const {
+        return run_batch<item_id>(positions.size(), [&](size_t q) { return positions[q]; }, [&](size_t q, auto out) {
+            within_radius(c, positions[q], r, out);
+        });
+    }
+    batch_results<item_id> batch_nearest(cursor& c, const std::vector<Position>& positions, size_t k) const {
+        return run_batch<item_id>(positions.size(), [&](size_t q) { return positions[q]; }, [&](size_t q, auto out) {
+            nearest(c, positions[q], k, out);
+        });
+    }
+    std::vector<std::tuple<node_id, area, size_t>> batch_find_node(const std::vector<Position>& positions) {
+        return batch_find_node(own_cursor, positions);
+    }
+    batch_results<item_id> batch_get_items_within_area(const std::vector<area>& areas) {
+        return batch_get_items_within_area(own_cursor, areas);
+    }
+    batch_results<item_id> batch_within_radius(const std::vector<Position>& positions, Coord r) {
+        return batch_within_radius(own_cursor, positions, r);
+    }
+    batch_results<item_id> batch_nearest(const std::vector<Position>& positions, size_t k) {
+        return batch_nearest(own_cursor, positions, k);
+    }
+
+private:
+    //two subtrees whose items are paired up, the same node twice for the
+    //pairs inside one subtree
+    struct node_pair {
+        node_id a;
+        area a_area;
+        node_id b;
+        area b_area;
+    };
+    //calls g(node_pair) for the child pairs of p that can hold a pair
+    //within r2, and returns false if p is two leaves, which cannot split
+    //a node paired with itself splits into the unordered pairs of its
+    //children, otherwise the larger node splits against the other, so each
+    //pair of leaves is reached from exactly one path
+    template<typename G>
+    bool split_pair(const node_pair& p, double r2, G&& g) const {
+        const node& a = nodes[p.a];
+        const node& b = nodes[p.b];
+        bool a_leaf = a.child_nodes_index == INVALID_NODE_ID;
+        bool b_leaf = b.child_nodes_index == INVALID_NODE_ID;
+        if (a_leaf && b_leaf) {
+            return false;
+        }
+        if (p.a == p.b) {
+            for (size_t c = 0; c < num_child_nodes; c++) {
+                node_id ca = a.child_nodes_index + c;
+                area ca_area = p.a_area.child(c);
+                for (size_t d = c; d < num_child_nodes; d++) {
+                    area cb_area = p.a_area.child(d);
+                    if (ca_area.distance2(cb_area) <= r2) {
+                        g(node_pair {ca, ca_area, static_cast<node_id>(a.child_nodes_index + d), cb_area});
+                    }
+                }
+            }
+        } else if (b_leaf || (!a_leaf && p.a_area.max[0] - p.a_area.min[0] >= p.b_area.max[0] - p.b_area.min[0])) {
+            for (size_t c = 0; c < num_child_nodes; c++) {
+                area ca_area = p.a_area.child(c);
+                if (ca_area.distance2(p.b_area) <= r2) {
+                    g(node_pair {static_cast<node_id>(a.child_nodes_index + c), ca_area, p.b, p.b_area});
+                }
+            }
+        } else {
+            for (size_t c = 0; c < num_child_nodes; c++) {
+                area cb_area = p.b_area.child(c);
+                if (p.a_area.distance2(cb_area) <= r2) {
+                    g(node_pair {p.a, p.a_area, static_cast<node_id>(b.child_nodes_index + c), cb_area});
+                }
+            }
+        }
+        return true;
+    }
+    template<typename F>
+    void join_pair(const node_pair& p, Coord r, double r2, F& f) const {
+        bool split = split_pair(p, r2, [&](const node_pair& child) {
+            join_pair(child, r, r2, f);
+        });
+        if (split) {
+            return;
+        }
+        //two leaves, each item of a tested against b with the sphere kernel
+        const node& b = nodes[p.b];
+        for_each_leaf_item(nodes[p.a], [&](item_id i) {
+            for_each_leaf_item_within(b, items[i].pos, r, [&](item_id j) {
+                if (p.a != p.b || i < j) {
+                    f(i, j);
+                }
+            });
+        });
+    }
+public:
+    //calls f(item_id, item_id) once for every unordered pair of items
+    //within distance r of each other
+    //a dual tree walk: each leaf meets itself and the leaves near enough
+    //to it once, pruned by the distance between node boxes
+    template<typename F>
+    void for_each_pair_within(Coord r, F&& f) const {
+        double r2 = static_cast<double>(r) * static_cast<double>(r);
+        join_pair({0, root_area, 0, root_area}, r, r2, f);
+    }
+    std::vector<std::pair<item_id, item_id>> pairs_within(Coord r) const {
+        std::vector<std::pair<item_id, item_id>> out;
+        for_each_pair_within(r, [&](item_id i, item_id j) {
+            out.push_back({i, j});
+        });
+        return out;
+    }
+    //the same pairs, the node pairs split until there are a few per thread
+    //and each run on its own, then gathered in node pair order
+    std::vector<std::pair<item_id, item_id>> pairs_within(Coord r, parallel::thread_pool& threads) const {
+        double r2 = static_cast<double>(r) * static_cast<double>(r);
+        std::vector<node_pair> tasks {{0, root_area, 0, root_area}};
+        bool more = true;
+        while (more && tasks.size() < threads.size() * 16) {
+            more = false;
+            std::vector<node_pair> next;
+            for (const node_pair& p: tasks) {
+                bool split = split_pair(p, r2, [&](const node_pair& child) {
+                    next.push_back(child);
+                });
+                if (split) {
+                    more = true;
+                } else {
+                    next.push_back(p);
+                }
+            }
+            tasks.swap(next);
+        }
+        std::vector<std::vector<std::pair<item_id, item_id>>> found(tasks.size());
+        threads.parallel_for(tasks.size(), [&](size_t t) {
+            auto emit = [&](item_id i, item_id j) {
+                found[t].push_back({i, j});
+            };
+            join_pair(tasks[t], r, r2, emit);
+        });
+        std::vector<std::pair<item_id, item_id>> out;
+        for (auto& f: found) {
+            out.insert(out.end(), f.begin(), f.end());
+        }
+        return out;
+    }
+
+    //origin + t * direction for t in [0, length]
+    //an item is hit where the ray passes through its unit cell [pos, pos + 1)
+    struct ray {
+        std::array<double, Dimension> origin;
+        std::array<double, Dimension> direction;
+        double length = std::numeric_limits<double>::infinity();
+
+        //the part [t0, t1] of the ray inside a, t0 > t1 when it misses
+        std::pair<double, double> interval(const area& a) const {
+            double t0 = 0;
+            double t1 = length;
+            for (size_t i = 0; i < Dimension; i++) {
+                auto [lo, hi] = slab(i, a.min[i], a.max[i]);
+                t0 = std::max(t0, lo);
+                t1 = std::min(t1, hi);
+            }
+            return {t0, t1};
+        }
+        //the t interval where coordinate i lies between min and max
+        std::pair<double, double> slab(size_t i, double min, double max) const {
+            constexpr double inf = std::numeric_limits<double>::infinity();
+            if (direction[i] == 0) {
+                return origin[i] >= min && origin[i] < max ? std::pair {-inf, inf} : std::pair {inf, -inf};
+            }
+            double a = (min - origin[i]) / direction[i];
+            double b = (max - origin[i]) / direction[i];
+            return direction[i] > 0 ? std::pair {a, b} : std::pair {b, a};
+        }
+    };
+    //the half space normal . p + offset >= 0
+    struct plane {
+        std::array<double, Dimension> normal;
+        double offset;
+
+        double distance(const Position& p) const {
+            double d = offset;
+            for (size_t i = 0; i < Dimension; i++) {
+                d += normal[i] * static_cast<double>(p[i]);
+            }
+            return d;
+        }
+    };
+
+private:
+    static area cell(const Position& p) {
+        area a;
+        for (size_t i = 0; i < Dimension; i++) {
+            a.min[i] = p[i];
+            a.max[i] = p[i] + 1;
+        }
+        return a;
+    }
+    //visits the leaves the ray passes through, front to back, calling
+    //on_leaf(node_id) until limit, which on_leaf may shrink, is passed
+    //each node carries its slab intervals, a child's are its parent's split
+    //at the slab midpoints, so no box is intersected from scratch
+    template<typename F>
+    void cast_node(node_id id, const area& a, const std::array<std::pair<double, double>, Dimension>& slabs, const ray& r, double& limit, F& on_leaf) const {
+        const node& n = nodes[id];
+        if (n.child_nodes_index == INVALID_NODE_ID) {
+            on_leaf(id);
+            return;
+        }
+        struct hit {
+            double t0;
+            size_t c;
+            std::array<std::pair<double, double>, Dimension> slabs;
+        };
+        std::array<hit, num_child_nodes> hits;
+        size_t num_hits = 0;
+        Coord half = (a.max[0] - a.min[0]) / 2;
+        std::array<double, Dimension> mid;
+        for (size_t i = 0; i < Dimension; i++) {
+            mid[i] = r.direction[i] == 0 ? 0 : (static_cast<double>(a.min[i] + half) - r.origin[i]) / r.direction[i];
+        }
+        for (size_t c = 0; c < num_child_nodes; c++) {
+            hit h {0, c, slabs};
+            double t1 = limit;
+            for (size_t i = 0; i < Dimension; i++) {
+                bool upper = (c >> i) & 1;
+                auto& [lo, hi] = h.slabs[i];
+                if (r.direction[i] == 0) {
+                    if (upper != (r.origin[i] >= static_cast<double>(a.min[i] + half))) {
+                        lo = std::numeric_limits<double>::infinity();
+                    }
+                } else if (upper == (r.direction[i] > 0)) {
+                    lo = mid[i];
+                } else {
+                    hi = mid[i];
+                }
+                h.t0 = std::max(h.t0, lo);
+                t1 = std::min(t1, hi);
+            }
+            if (h.t0 <= t1) {
+                //insertion sort on entry, at most 2^Dimension children
+                size_t j = num_hits++;
+                for (; j > 0 && hits[j - 1].t0 > h.t0; j--) {
+                    hits[j] = hits[j - 1];
+                }
+                hits[j] = h;
+            }
+        }
+        for (size_t j = 0; j < num_hits; j++) {
+            if (hits[j].t0 > limit) {
+                return;
+            }
+            cast_node(n.child_nodes_index + hits[j].c, a.child(hits[j].c), hits[j].slabs, r, limit, on_leaf);
+        }
+    }
+    template<typename F>
+    void cast(const ray& r, double& limit, F&& on_leaf) const {
+        std::array<std::pair<double, double>, Dimension> slabs;
+        double t0 = 0;
+        double t1 = limit;
+        for (size_t i = 0; i < Dimension; i++) {
+            slabs[i] = r.slab(i, root_area.min[i], root_area.max[i]);
+            t0 = std::max(t0, slabs[i].first);
+            t1 = std::min(t1, slabs[i].second);
+        }
+        if (t0 <= t1) {
+            cast_node(0, root_area, slabs, r, limit, on_leaf);
+        }
+    }
+public:
+    //the first item the ray hits and where, or nothing
+    //leaves are visited in order of entry, so the walk ends at the first
+    //node entered beyond the closest hit so far
+    std::optional<std::pair<item_id, double>> first_hit(const ray& r) const {
+        std::optional<std::pair<item_id, double>> best;
+        double limit = r.length;
+        cast(r, limit, [&](node_id id) {
+            for_each_leaf_item(nodes[id], [&](item_id i) {
+                auto [t0, t1] = r.interval(cell(items[i].pos));
+                if (t0 <= t1 && t0 <= limit && (!best || t0 < best->second || (t0 == best->second && i < best->first))) {
+                    best = {i, t0};
+                    limit = t0;
+                }
+            });
+        });
+        return best;
+    }
+    //calls f(item_id, t) for every item the ray hits, leaf by leaf front to
+    //back, with t where the ray enters it
+    template<typename F>
+    void for_each_hit(const ray& r, F&& f) const {
+        double limit = r.length;
+        cast(r, limit, [&](node_id id) {
+            for_each_leaf_item(nodes[id], [&](item_id i) {
+                auto [t0, t1] = r.interval(cell(items[i].pos));
+                if (t0 <= t1) {
+                    f(i, t0);
+                }
+            });
+        });
+    }
+    //every item the ray hits, nearest first
+    std::vector<std::pair<item_id, double>> all_hits(const ray& r) const {
+        std::vector<std::pair<item_id, double>> out;
+        for_each_hit(r, [&](item_id i, double t) {
+            out.push_back({i, t});
+        });
+        std::sort(out.begin(), out.end(), [](auto& a, auto& b) {
+            return a.second < b.second || (a.second == b.second && a.first < b.first);
+        });
+        return out;
+    }
+
+    //calls f(item_id) for every item inside all of planes, at most 64
+    //a plane that holds the whole of a node is dropped for its subtree, and
+    //a subtree no plane cuts is reported without testing its items
+    template<typename F>
+    void for_each_item_in_frustum(const std::vector<plane>& planes, F&& f) const {
+        assert(planes.size() <= 64);
+        struct frame {
+            node_id id;
+            area node_area;
+            uint64_t active;
+            size_t next_child;
+        };
+        std::array<frame, root_level + 1> frames;
+        frames[0] = {0, root_area, kernels::low_mask(planes.size()), 0};
+        size_t depth = 0;
+        //drops the planes holding all of a, false if one holds none of it
+        auto classify = [&](const area& a, uint64_t& active) {
+            for (uint64_t m = active; m != 0; m &= m - 1) {
+                size_t p = __builtin_ctzll(m);
+                Position nearest;
+                Position farthest;
+                for (size_t i = 0; i < Dimension; i++) {
+                    bool positive = planes[p].normal[i] >= 0;
+                    nearest[i] = positive ? a.min[i] : a.max[i] - 1;
+                    farthest[i] = positive ? a.max[i] - 1 : a.min[i];
+                }
+                if (planes[p].distance(farthest) < 0) {
+                    return false;
+                }
+                if (planes[p].distance(nearest) >= 0) {
+                    active &= ~(uint64_t{1} << p);
+                }
+            }
+            return true;
+        };
+        if (!classify(root_area, frames[0].active)) {
+            return;
+        }
+        while (true) {
+            frame& fr = frames[depth];
+            const node& n = nodes[fr.id];
+            if (n.child_nodes_index == INVALID_NODE_ID) {
+                for_each_leaf_item(n, [&](item_id i) {
+                    for (uint64_t m = fr.active; m != 0; m &= m - 1) {
+                        if (planes[__builtin_ctzll(m)].distance(items[i].pos) < 0) {
+                            return;
+                        }
+                    }
+                    f(i);
+                });
+                fr.next_child = num_child_nodes;
+            }
+            if (fr.next_child == num_child_nodes) {
+                if (depth == 0) {
+                    return;
+                }
+                depth--;
+                continue;
+            }
+            size_t c = fr.next_child++;
+            area child_area = fr.node_area.child(c);
+            uint64_t active = fr.active;
+            if (active == 0 || classify(child_area, active)) {
+                frames[depth + 1] = {static_cast<node_id>(n.child_nodes_index + c), child_area, active, 0};
+                depth++;
+            }
+        }
+    }
+    std::vector<item_id> get_items_in_frustum(const std::vector<plane>& planes) const {
+        std::vector<item_id> out;
+        for_each_item_in_frustum(planes, [&](item_id i) {
+            out.push_back(i);
+        });
+        return out;
+    }
+
+    //counters since the last reset_stats, the cursor's query counters, and
+    //the shape and heap use of the tree as it stands
+    struct stats_snapshot {
+        query_stats queries;
+        size_t splits = 0;
+        size_t merges = 0;
+        //leaves by item count, the last bucket holds the chained leaves of
+        //level 0 that outgrew max_items_per_node
+        std::array<size_t, max_items_per_node + 2> leaf_occupancy {};
+        //leaves and items by depth
+        std::array<size_t, root_level + 1> leaves_by_depth {};
+        std::array<size_t, root_level + 1> items_by_depth {};
+        size_t node_bytes = 0;
+        size_t item_bytes = 0;
+        size_t index_bytes = 0;
+        //leaf item storage outside the nodes, pool blocks or leaf vectors
+        size_t leaf_bytes = 0;
+    };
+    stats_snapshot stats(const cursor& c) const {
+        static_assert(with_stats, "stats needs a tree with with_stats set");
+        stats_snapshot out;
+        out.queries = c.stats;
+        out.splits = changes.splits;
+        out.merges = changes.merges;
+        std::vector<std::pair<node_id, size_t>> stack {{0, 0}};
+        while (!stack.empty()) {
+            auto [id, depth] = stack.back();
+            stack.pop_back();
+            const node& n = nodes[id];
+            if (n.child_nodes_index != INVALID_NODE_ID) {
+                for (size_t c = 0; c < num_child_nodes; c++) {
+                    stack.push_back({static_cast<node_id>(n.child_nodes_index + c), depth + 1});
+                }
+                continue;
+            }
+            size_t count = leaf_size(n);
+            out.leaf_occupancy[std::min(count, max_items_per_node + 1)]++;
+            out.leaves_by_depth[depth]++;
+            out.items_by_depth[depth] += count;
+            if constexpr (leaf_storage == storage::vector) {
+                out.leaf_bytes += n.items_indices.capacity() * sizeof(item_id);
+            }
+        }
+        if constexpr (leaf_storage == storage::pool) {
+            out.leaf_bytes = pool.bytes();
+        }
+        out.node_bytes = nodes.size() * sizeof(node) + free_node_blocks.capacity() * sizeof(node_id);
+        out.item_bytes = items.size() * sizeof(struct item) + free_items.capacity() * sizeof(item_id);
+        out.index_bytes = index->bytes();
+        return out;
+    }
+    stats_snapshot stats() const {
+        return stats(own_cursor);
+    }
+    //starts a new interval for the counters, cursors are reset on their own
+    void reset_stats() {
+        changes = {};
+        own_cursor.stats = {};
+    }
+    static void reset_stats(cursor& c) {
+        c.stats = {};
+    }
+
+    void post_insert_check() const {
         size_t items_in_tree = 0;
-        for (node& n: nodes) {
-            items_in_tree += n.items_indices.size();
+        for (size_t id = 0; id < nodes.size(); id++) {
+            const node& n = nodes[id];
+            items_in_tree += leaf_size(n);
+            assert(n.level == 0 || leaf_size(n) <= max_items_per_node);
+            assert(n.child_nodes_index == INVALID_NODE_ID || leaf_size(n) == 0);
+            for_each_leaf_item(n, [&](item_id i) {
+                assert(items[i].node_index == id);
+            });
         }
-        assert(items_in_tree == items.size());
+        assert(items_in_tree + free_items.size() == items.size());
+        index->for_each([&](your_id id, item_id i) {
+            assert(i < items.size() && items[i].node_index != FREE_NODE_ID && items[i].id == id);
+        });
     }
+    //same items and nodes in the same slots, leaves in the same order
+    bool operator==(const tree& other) const {
+        if (nodes.size() != other.nodes.size() || items.size() != other.items.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < items.size(); i++) {
+            const item& a = items[i];
+            const item& b = other.items[i];
+            if (a.pos != b.pos || a.id != b.id || a.node_index != b.node_index) {
+                return false;
+            }
+        }
+        std::vector<item_id> a_items;
+        std::vector<item_id> b_items;
+        for (size_t id = 0; id < nodes.size(); id++) {
+            const node& a = nodes[id];
+            const node& b = other.nodes[id];
+            if (a.parent_node_index != b.parent_node_index || a.child_nodes_index != b.child_nodes_index || a.level != b.level) {
+                return false;
+            }
+            if constexpr (leaf_storage == storage::pool) {
+                if (a.items_block != b.items_block) {
+                    return false;
+                }
+            }
+            a_items.clear();
+            b_items.clear();
+            for_each_leaf_item(a, [&](item_id i) { a_items.push_back(i); });
+            other.for_each_leaf_item(b, [&](item_id i) { b_items.push_back(i); });
+            if (a_items != b_items) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+//one writer changes a copy_on_write tree in batches while any number of
+//readers query the last published snapshot of it
+//publish() shares every chunk the writer has not written since the last
+//publish, so it costs one pointer per chunk, and an old version is freed
+//with its last reader
+template<typename Tree>
+struct snapshots {
+    static_assert(Tree::is_copy_on_write, "snapshots needs a copy_on_write tree");
+
+    //the writer's tree, only to be used from the writer's thread
+    Tree& writer() {
+        return writer_tree;
+    }
+    //makes the writer's current state the one readers get
+    void publish() {
+        std::atomic_store(&current, writer_tree.snapshot());
+    }
+    //the last published state, unchanged for as long as it is held
+    std::shared_ptr<const Tree> read() const {
+        return std::atomic_load(&current);
+    }
+private:
+    Tree writer_tree;
+    std::shared_ptr<const Tree> current = writer_tree.snapshot();
 };
 
 }